@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "arena.h"
+
+#define CHUNK_SIZE (64u<<10)
+#define ALIGN 16
+
+struct chunk {
+	struct chunk *next;
+	size_t size, used;
+	_Alignas(ALIGN) unsigned char data[];
+};
+
+struct deferred {
+	struct deferred *next;
+	void (*fn)(void *);
+	void *ptr;
+};
+
+struct arena {
+	struct chunk *chunks;
+	struct deferred *deferred;
+	struct arena_stats stats;
+};
+
+static struct arena *current;
+
+struct arena *arena_new(void) {
+	return tmalloc(struct arena, 1);
+}
+
+void arena_free(struct arena *a) {
+	if (!a)
+		return;
+	if (current == a)
+		current = NULL;
+	// Deferred entries are in the arena, take them all before freeing
+	for (auto d = a->deferred; d; d = d->next)
+		d->fn(d->ptr);
+	auto c = a->chunks;
+	while (c) {
+		auto next = c->next;
+		free(c);
+		c = next;
+	}
+	free(a);
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+	size = (size+ALIGN-1)&~(size_t)(ALIGN-1);
+	auto c = a->chunks;
+	if (!c || c->size-c->used < size) {
+		// Big allocations get a chunk of their own, behind the
+		// current one so its free space isn't lost
+		size_t csize = size > CHUNK_SIZE/4 ? size : CHUNK_SIZE;
+		auto n = (struct chunk *)malloc(sizeof(struct chunk)+csize);
+		if (!n)
+			return NULL;
+		n->size = csize;
+		n->used = 0;
+		if (c && csize != CHUNK_SIZE) {
+			n->next = c->next;
+			c->next = n;
+		} else {
+			n->next = c;
+			a->chunks = n;
+		}
+		a->stats.reserved += csize;
+		c = n;
+	}
+	void *ret = c->data+c->used;
+	c->used += size;
+	a->stats.used += size;
+	memset(ret, 0, size);
+	return ret;
+}
+
+void arena_defer(struct arena *a, void (*fn)(void *), void *ptr) {
+	auto d = (struct deferred *)arena_alloc(a, sizeof(struct deferred));
+	d->fn = fn;
+	d->ptr = ptr;
+	d->next = a->deferred;
+	a->deferred = d;
+	a->stats.ndefer++;
+}
+
+void arena_get_stats(const struct arena *a, struct arena_stats *s) {
+	*s = a->stats;
+}
+
+struct arena *arena_set_current(struct arena *a) {
+	auto prev = current;
+	current = a;
+	return prev;
+}
+
+struct arena *arena_current(void) {
+	return current;
+}
+
+void *arena_zalloc(size_t size) {
+	return current ? arena_alloc(current, size) : calloc(1, size);
+}
+
+void arena_defer_current(void (*fn)(void *), void *ptr) {
+	if (current)
+		arena_defer(current, fn, ptr);
+}
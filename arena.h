@@ -0,0 +1,39 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory that lives as long as a scene. Allocations are bumped out of
+// big chunks and are never freed on their own, arena_free() drops all of
+// them at once. Things that hold on to memory or resources elsewhere
+// (fbs, the interpolate_man, tapes) register a cleanup with arena_defer().
+//
+// Constructors of vars, objects and scenes allocate from the current
+// arena, see arena_set_current(), so scene building code doesn't have to
+// pass an arena around. Without a current arena they fall back to
+// calloc(), and what they make is never freed. Main thread only.
+
+struct arena;
+
+struct arena_stats {
+	size_t used;     // bytes handed out
+	size_t reserved; // bytes in chunks
+	size_t ndefer;
+};
+
+struct arena *arena_new(void);
+// Run the cleanups, newest first, then free all the memory
+void arena_free(struct arena *);
+// Zeroed, aligned to 16 bytes
+void *arena_alloc(struct arena *, size_t size);
+void arena_defer(struct arena *, void (*fn)(void *), void *ptr);
+void arena_get_stats(const struct arena *, struct arena_stats *);
+
+// Returns the previous current arena, NULL for none
+struct arena *arena_set_current(struct arena *);
+struct arena *arena_current(void);
+// From the current arena, or calloc()
+void *arena_zalloc(size_t size);
+// Cleanup for the current arena, nothing if there is none
+void arena_defer_current(void (*fn)(void *), void *ptr);
+
+#define amalloc(type, nmem) (type *)arena_zalloc(sizeof(type)*(nmem))
@@ -6,11 +6,23 @@
 
 struct fb;
 struct udev;
+struct region;
 struct backend {
 	bool busy; // indicates whether we could call queue_frame()
+	// Frames committed to the display but not on screen yet. A frame
+	// queued now is shown that many vblanks after the next one.
+	int in_flight;
+	// A frame is waiting for the pending flip before it can be
+	// committed. Queueing another one replaces it.
+	bool queued;
 	uint32_t w, h, cursor_w, cursor_h;
 	void *user_data;
 	void (*page_flip_cb)(EV_P_ void *user_data);
+
+	// vblank counter and CLOCK_MONOTONIC timestamp (in seconds) of the
+	// last page flip, valid when page_flip_cb() is called
+	uint64_t flip_seq;
+	double flip_time;
 };
 
 enum fb_purpose_t {
@@ -27,17 +39,41 @@ struct backend_ops {
 
 	// Queue one frame, it shoud be submitted to output
 	// immediately, and page_flip_cb() should be called
-	// when queued frame is presented.
+	// when queued frame is presented. fb is still owned
+	// by the caller, and can be rendered to again as soon
+	// as this returns.
+	//
+	// If a flip is still pending, the frame can wait for it
+	// in a spare buffer. A frame that is already waiting there
+	// is replaced, only the newest one is shown.
+	//
+	// damage is what changed in fb since the last queued
+	// frame, only that will be copied out of fb. NULL means
+	// everything changed.
 	//
 	// Return: -1 bust, -2 invalid fb
 	int (*queue_frame)(struct backend *b, struct fb *fb,
-	                    uint32_t cursor_x, uint32_t cursor_y);
+	                   const struct region *damage,
+	                   uint32_t cursor_x, uint32_t cursor_y);
 
 	// fb has to be exactly cursor_w * cursor_h
 	bool (*set_cursor)(struct backend *b, struct fb *fb);
 
-	// Create a fb that's suitable as to be used as a frame
+	// Create a fb that's suitable as to be used as a frame.
+	// RENDER_FB fbs are long lived, and should be given back
+	// with free_fb() instead of being freed.
 	struct fb *(*new_fb)(struct backend *b, int purpose);
+	void (*free_fb)(struct backend *b, struct fb *fb);
 };
 
 extern const struct backend_ops drm_ops;
+// Number of primary buffers, 2 to 4, has to be set before setup(). With 2
+// queue_frame() is bust until the last flip completes; with 3 or more one
+// frame can wait for the display while another is being scanned out.
+void drm_set_buffers(int n);
+
+// Renders into memory, with vblank simulated by a timer. Frames can be
+// dumped to dump_dir as PPM. Both have to be set before setup().
+extern const struct backend_ops headless_ops;
+void headless_set_refresh_rate(double hz);
+void headless_set_dump_dir(const char *dir);
@@ -12,6 +12,10 @@
 #include "common.h"
 #include "backend.h"
 #include "render.h"
+#include "region.h"
+#include "list.h"
+#include "stats.h"
+#include "trace.h"
 
 #define ERET(expr) do { \
 	__auto_type ret = (expr); \
@@ -38,18 +42,42 @@ struct plane {
 	int id;
 	struct plane_prop_ids pid;
 };
+// CPU side buffer handed out as RENDER_FB, recycled through free_fb()
+struct shadow_fb {
+	struct fb base;
+	struct list_head siblings;
+};
+
+#define MAX_BUFFERS 4
+#define CURSOR_FB MAX_BUFFERS
+
+static struct {
+	int nbuffers;
+} config = {
+	.nbuffers = 3,
+};
+
 struct drm_backend {
 	struct backend base;
 	ev_io iow;
 	drmModeCrtcPtr crtc;
+	// Where the cursor goes when the queued frame is committed
 	uint32_t cursor_x, cursor_y;
 	int fd;
 	EV_P;
 
-	// 0,1 double primary fb, 2 cursor fb
-	struct fb_params fb[3];
+	// nbuffers primary fbs, then the cursor fb at CURSOR_FB
+	int nbuffers;
+	struct fb_params fb[MAX_BUFFERS+1];
 	struct plane plane[2]; // 0 is primary, 1 is cursor
-	uint8_t front;
+	// The primary fb on screen, the one committed and waiting for
+	// vblank, and the one waiting for that flip to be committed. -1
+	// when there isn't one.
+	int front, pending, queued;
+
+	// Parts of each primary fb that are out of date
+	struct region stale[MAX_BUFFERS];
+	struct list_head free_shadows;
 };
 
 struct prop_info {
@@ -328,12 +356,69 @@ free_dumb:;
 	return ret;
 }
 
+void drm_set_buffers(int n) {
+	if (n >= 2 && n <= MAX_BUFFERS)
+		config.nbuffers = n;
+	else
+		fprintf(stderr, "Number of buffers has to be between 2 and %d\n", MAX_BUFFERS);
+}
+
+// A primary fb that is neither on screen nor waiting to be
+static int free_buffer(struct drm_backend *b) {
+	for (int i = 0; i < b->nbuffers; i++)
+		if (i != b->front && i != b->pending && i != b->queued)
+			return i;
+	return -1;
+}
+
+// What the main loop needs to know about the buffers
+static void update_status(struct drm_backend *b) {
+	b->base.busy = b->queued < 0 && free_buffer(b) < 0;
+	b->base.in_flight = b->pending >= 0;
+	b->base.queued = b->queued >= 0;
+}
+
+static int commit_frame(struct drm_backend *b, int buf) {
+	double t0 = stats_now();
+	auto atomic = atomic_begin();
+	atomic_add(atomic, b->plane[0].id, b->plane[0].pid.fb_id, b->fb[buf].fb);
+	atomic_add(atomic, b->plane[0].id, b->plane[0].pid.crtc_id, b->crtc->crtc_id);
+
+	// cursor_x,y is in internal coord, where x is the row, y is the col.
+	// crtc_x,y is in drm coord, where x is the horiz axis, y is the vert
+	atomic_add(atomic, b->plane[1].id, b->plane[1].pid.crtc_x, b->cursor_y);
+	atomic_add(atomic, b->plane[1].id, b->plane[1].pid.crtc_y, b->cursor_x);
+	ERET(atomic_check(atomic, b->fd));
+	ERET(atomic_commit(atomic, b->fd, b));
+	drmModeAtomicFree(atomic);
+	double t1 = stats_now();
+	stats_record(PHASE_COMMIT, t1-t0);
+	stats_queued(t1);
+	b->pending = buf;
+	return 0;
+
+err_out:
+	drmModeAtomicFree(atomic);
+	return -1;
+}
+
 static void
 drm_page_flip_handler(int fd, unsigned int seq,
                       unsigned int sec, unsigned int usec,
                       void *ud) {
 	struct drm_backend *b = ud;
-	b->base.busy = false;
+	b->front = b->pending;
+	b->pending = -1;
+	b->base.flip_seq = seq;
+	b->base.flip_time = sec+usec/1e6;
+	stats_flip(seq, b->base.flip_time);
+	trace_instant("page_flip", "seq", seq);
+
+	// The waiting frame goes out for the next vblank. If that fails it
+	// stays queued, and goes out with the next frame instead.
+	if (b->queued >= 0 && commit_frame(b, b->queued) == 0)
+		b->queued = -1;
+	update_status(b);
 	if (b->base.page_flip_cb)
 		b->base.page_flip_cb(b->EV_A_ b->base.user_data);
 }
@@ -373,10 +458,18 @@ struct backend *drm_setup(EV_P_ struct udev *u, uint32_t w, uint32_t h) {
 	ERET(drmGetCap(fd, DRM_CAP_CURSOR_HEIGHT, &tmp));
 	b->base.cursor_h = tmp;
 
-	ERET(init_fb(fd, b->base.w, b->base.h, 24, &b->fb[0]));
-	ERET(init_fb(fd, b->base.w, b->base.h, 24, &b->fb[1]));
-	ERET(init_fb(fd, b->base.cursor_w, b->base.cursor_h, 32, &b->fb[2]));
+	b->nbuffers = config.nbuffers;
+	for (int i = 0; i < b->nbuffers; i++)
+		ERET(init_fb(fd, b->base.w, b->base.h, 24, &b->fb[i]));
+	ERET(init_fb(fd, b->base.cursor_w, b->base.cursor_h, 32, &b->fb[CURSOR_FB]));
 	b->front = 0;
+	b->pending = b->queued = -1;
+	INIT_LIST_HEAD(&b->free_shadows);
+	struct box screen = { 0, 0, b->base.h, b->base.w };
+	for (int i = 0; i < b->nbuffers; i++) {
+		region_init(&b->stale[i]);
+		region_add_box(&b->stale[i], &screen);
+	}
 
 	auto pres = drmModeGetPlaneResources(fd);
 	ERET(find_plane_by_type(pres, fd, DRM_PLANE_TYPE_PRIMARY, &b->plane[0]));
@@ -389,13 +482,14 @@ struct backend *drm_setup(EV_P_ struct udev *u, uint32_t w, uint32_t h) {
 	atomic = atomic_begin();
 	ERET(setup_plane(atomic, fd, &b->plane[0], b->base.w, b->base.h));
 	ERET(setup_plane(atomic, fd, &b->plane[1], b->base.cursor_w, b->base.cursor_h));
-	atomic_add(atomic, b->plane[1].id, b->plane[1].pid.fb_id, b->fb[2].fb);
+	atomic_add(atomic, b->plane[1].id, b->plane[1].pid.fb_id, b->fb[CURSOR_FB].fb);
 	atomic_add(atomic, b->plane[1].id, b->plane[1].pid.crtc_id, b->crtc->crtc_id);
 	ERET(atomic_commit_sync(atomic, fd));
 	drmModeAtomicFree(atomic);
 	atomic = NULL;
 
 	b->fd = fd;
+	fprintf(stderr, "Using %d primary buffers\n", b->nbuffers);
 	return &b->base;
 err_out:
 	if (atomic)
@@ -408,57 +502,91 @@ err_out:
 	return NULL;
 }
 
+static void
+upload_region(struct fb_params *dst, const struct fb *src, const struct region *r) {
+	auto bpp = pixfmt_bpp(src->pixfmt);
+	for (int i = 0; i < r->nbox; i++) {
+		auto bx = &r->box[i];
+		if (bx->y1 == 0 && bx->y2 == src->width && src->pitch == dst->pitch) {
+			// Whole rows, copy them in one go
+			memcpy(dst->map+bx->x1*dst->pitch, src->data+bx->x1*src->pitch,
+			       (bx->x2-bx->x1)*dst->pitch);
+			continue;
+		}
+		for (int32_t j = bx->x1; j < bx->x2; j++)
+			memcpy(dst->map+j*dst->pitch+bx->y1*bpp,
+			       src->data+j*src->pitch+bx->y1*bpp, (bx->y2-bx->y1)*bpp);
+	}
+}
+
 static int
-drm_queue_frame(struct backend *_b, struct fb *fb,
+drm_queue_frame(struct backend *_b, struct fb *fb, const struct region *damage,
                 uint32_t cursor_x, uint32_t cursor_y) {
 	struct drm_backend *b = (void *)_b;
-	if (b->base.busy)
-		return -1;
-
-	if (fb->pitch != b->fb[0].pitch ||
-	    fb->pitch*fb->height != b->fb[0].size ||
-	    fb->width != b->fb[0].w ||
+	if (fb->width != b->fb[0].w ||
 	    fb->height != b->fb[0].h)
 		return -2;
+	uint64_t tr = trace_begin();
+
+	// A buffer is as old as the last frame uploaded to it, so it needs
+	// this frame's damage and whatever it missed since. Damage is
+	// recorded even if we are busy, so a dropped frame isn't lost.
+	struct box screen = { 0, 0, fb->height, fb->width };
+	for (int i = 0; i < b->nbuffers; i++) {
+		if (damage)
+			region_union(&b->stale[i], damage);
+		else
+			region_add_box(&b->stale[i], &screen);
+	}
 
-	memcpy(b->fb[b->front^1].map, fb->data, b->fb[0].size);
-	b->front ^= 1;
-
-	auto atomic = atomic_begin();
-	atomic_add(atomic, b->plane[0].id, b->plane[0].pid.fb_id, b->fb[b->front].fb);
-	atomic_add(atomic, b->plane[0].id, b->plane[0].pid.crtc_id, b->crtc->crtc_id);
-
-	// cursor_x,y is in internal coord, where x is the row, y is the col.
-	// crtc_x,y is in drm coord, where x is the horiz axis, y is the vert
-	atomic_add(atomic, b->plane[1].id, b->plane[1].pid.crtc_x, cursor_y);
-	atomic_add(atomic, b->plane[1].id, b->plane[1].pid.crtc_y, cursor_x);
-	ERET(atomic_check(atomic, b->fd));
-	ERET(atomic_commit(atomic, b->fd, b));
-	drmModeAtomicFree(atomic);
-	atomic = NULL;
-
-	b->base.busy = true;
-	free(fb->data);
-	free(fb);
-	return 0;
+	// Mailbox: a frame still waiting for the pending flip is replaced,
+	// it was going to be out of date anyway
+	int buf = b->queued;
+	if (buf >= 0)
+		stats_replaced();
+	else
+		buf = free_buffer(b);
+	if (buf < 0) {
+		trace_end("drm_queue_frame", tr);
+		return -1;
+	}
 
-err_out:
-	if (atomic)
-		drmModeAtomicFree(atomic);
-	return -3;
+	double t0 = stats_now();
+	region_clip(&b->stale[buf], &screen);
+	upload_region(&b->fb[buf], fb, &b->stale[buf]);
+	region_clear(&b->stale[buf]);
+	stats_record(PHASE_UPLOAD, stats_now()-t0);
+	b->cursor_x = cursor_x;
+	b->cursor_y = cursor_y;
+
+	// Only one flip can be pending, the frame waits for it otherwise
+	int ret = 0;
+	if (b->pending >= 0 && b->queued < 0)
+		stats_waiting();
+	b->queued = buf;
+	if (b->pending < 0) {
+		if (commit_frame(b, buf) == 0)
+			b->queued = -1;
+		else
+			ret = -3;
+	}
+	update_status(b);
+	trace_end("drm_queue_frame", tr);
+	return ret;
 }
 
 static bool
 drm_set_cursor(struct backend *_b, struct fb *fb) {
 	struct drm_backend *b = (void *)_b;
-	if (fb->pitch > b->fb[2].pitch ||
-	    fb->width > b->fb[2].w ||
-	    fb->height > b->fb[2].h)
+	auto cursor = &b->fb[CURSOR_FB];
+	if (fb->width > cursor->w ||
+	    fb->height > cursor->h)
 		return false;
 
-	memset(b->fb[2].map, 0, b->fb[2].size);
+	memset(cursor->map, 0, cursor->size);
 	for (int i = 0; i < fb->height; i++)
-		memcpy(b->fb[2].map+i*b->fb[2].pitch, fb->data+i*fb->pitch, fb->pitch);
+		memcpy(cursor->map+i*cursor->pitch, fb->data+i*fb->pitch,
+		       fb->width*pixfmt_bpp(fb->pixfmt));
 	return true;
 }
 
@@ -466,18 +594,31 @@ static struct fb *
 drm_new_fb(struct backend *_b, int purpose) {
 	(void)purpose; // ignore for now
 	struct drm_backend *b = (void *)_b;
-	auto ret = tmalloc(struct fb, 1);
-	ret->pixfmt = XRGB8888;
-	ret->pitch = b->fb[0].pitch;
-	ret->height = b->fb[0].h;
-	ret->width = b->fb[0].w;
-	ret->data = calloc(ret->pitch, ret->height);
-	return ret;
+	if (!list_empty(&b->free_shadows)) {
+		auto ret = list_first_entry(&b->free_shadows, struct shadow_fb, siblings);
+		list_del(&ret->siblings);
+		return &ret->base;
+	}
+
+	auto ret = tmalloc(struct shadow_fb, 1);
+	if (!fb_alloc(&ret->base, b->fb[0].w, b->fb[0].h, XRGB8888)) {
+		free(ret);
+		return NULL;
+	}
+	return &ret->base;
+}
+
+static void
+drm_free_fb(struct backend *_b, struct fb *fb) {
+	struct drm_backend *b = (void *)_b;
+	struct shadow_fb *s = (void *)fb;
+	list_add(&s->siblings, &b->free_shadows);
 }
 
 const struct backend_ops drm_ops = {
 	.setup = drm_setup,
 	.queue_frame = drm_queue_frame,
 	.set_cursor = drm_set_cursor,
-	.new_fb = drm_new_fb
+	.new_fb = drm_new_fb,
+	.free_fb = drm_free_fb,
 };
@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ev.h>
+#include "common.h"
+#include "backend.h"
+#include "render.h"
+#include "region.h"
+#include "stats.h"
+#include "trace.h"
+
+// A backend without a display: frames are copied into memory, and a timer
+// plays the part of vblank. Lets the render loop run anywhere.
+//
+// Buffers work like the drm backend with 3 of them: a frame queued while
+// another waits for vblank waits behind it, and replaces any frame that
+// was already waiting there.
+
+#define DEFAULT_W 1920
+#define DEFAULT_H 1080
+#define DEFAULT_CURSOR 64
+#define NBUFFERS 3
+
+static struct {
+	double refresh_rate;
+	const char *dump_dir;
+} config = {
+	.refresh_rate = 60,
+};
+
+struct headless_backend {
+	struct backend base;
+	ev_timer vblank;
+	EV_P;
+
+	struct fb buf[NBUFFERS];
+	// Parts of each buffer that are out of date
+	struct region stale[NBUFFERS];
+	// The buffer "on screen", the one going on screen at the next vblank,
+	// and the one waiting for that. -1 when there isn't one.
+	int front, pending, queued;
+	uint64_t seq; // vblanks so far
+	uint64_t frames;
+	uint32_t cursor_x, cursor_y;
+};
+
+void headless_set_refresh_rate(double hz) {
+	if (hz > 0)
+		config.refresh_rate = hz;
+}
+
+void headless_set_dump_dir(const char *dir) {
+	free((void *)config.dump_dir);
+	config.dump_dir = dir ? strdup(dir) : NULL;
+}
+
+// As binary PPM, the X channel is dropped
+static void dump_frame(struct headless_backend *b) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/frame-%06lu.ppm", config.dump_dir, b->frames);
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	auto fb = &b->buf[b->front];
+	uint8_t *row = malloc(fb->width*3);
+	fprintf(f, "P6\n%d %d\n255\n", fb->width, fb->height);
+	for (int32_t i = 0; i < fb->height; i++) {
+		auto px = (const uint32_t *)(fb->data+i*fb->pitch);
+		for (int32_t j = 0; j < fb->width; j++) {
+			row[j*3] = px[j]>>16;
+			row[j*3+1] = px[j]>>8;
+			row[j*3+2] = px[j];
+		}
+		fwrite(row, 1, fb->width*3, f);
+	}
+	free(row);
+	fclose(f);
+}
+
+// A buffer that is neither on screen nor waiting to be
+static int free_buffer(struct headless_backend *b) {
+	for (int i = 0; i < NBUFFERS; i++)
+		if (i != b->front && i != b->pending && i != b->queued)
+			return i;
+	return -1;
+}
+
+static void update_status(struct headless_backend *b) {
+	b->base.in_flight = b->pending >= 0;
+	b->base.queued = b->queued >= 0;
+}
+
+static void vblank_cb(EV_P_ ev_timer *t, int revents) {
+	auto b = container_of(t, struct headless_backend, vblank);
+	b->seq++;
+	if (b->pending < 0)
+		return;
+
+	// Same as drm_page_flip_handler
+	b->front = b->pending;
+	b->pending = -1;
+	b->frames++;
+	if (config.dump_dir)
+		dump_frame(b);
+	b->base.flip_seq = b->seq;
+	b->base.flip_time = stats_now();
+	stats_flip(b->base.flip_seq, b->base.flip_time);
+	trace_instant("page_flip", "seq", b->base.flip_seq);
+
+	if (b->queued >= 0) {
+		b->pending = b->queued;
+		b->queued = -1;
+		stats_queued(stats_now());
+	}
+	update_status(b);
+	if (b->base.page_flip_cb)
+		b->base.page_flip_cb(EV_A_ b->base.user_data);
+}
+
+static struct backend *
+headless_setup(EV_P_ struct udev *u, uint32_t w, uint32_t h) {
+	auto b = tmalloc(struct headless_backend, 1);
+	b->base.w = w ? w : DEFAULT_W;
+	b->base.h = h ? h : DEFAULT_H;
+	b->base.cursor_w = b->base.cursor_h = DEFAULT_CURSOR;
+	struct box screen = { 0, 0, b->base.h, b->base.w };
+	for (int i = 0; i < NBUFFERS; i++) {
+		if (!fb_alloc(&b->buf[i], b->base.w, b->base.h, XRGB8888)) {
+			while (i--)
+				fb_release(&b->buf[i]);
+			free(b);
+			return NULL;
+		}
+		region_init(&b->stale[i]);
+		region_add_box(&b->stale[i], &screen);
+	}
+	b->front = 0;
+	b->pending = b->queued = -1;
+	b->EV_A = EV_A;
+
+	double interval = 1.0/config.refresh_rate;
+	ev_timer_init(&b->vblank, vblank_cb, interval, interval);
+	ev_timer_start(EV_A_ &b->vblank);
+	fprintf(stderr, "Headless %ux%u at %.2fHz\n", b->base.w, b->base.h,
+	        config.refresh_rate);
+	return &b->base;
+}
+
+static int
+headless_queue_frame(struct backend *_b, struct fb *fb, const struct region *damage,
+                     uint32_t cursor_x, uint32_t cursor_y) {
+	struct headless_backend *b = (void *)_b;
+	if (fb->width != b->buf[0].width || fb->height != b->buf[0].height)
+		return -2;
+
+	uint64_t tr = trace_begin();
+	double t0 = stats_now();
+	struct box screen = { 0, 0, fb->height, fb->width };
+	for (int i = 0; i < NBUFFERS; i++) {
+		if (damage)
+			region_union(&b->stale[i], damage);
+		else
+			region_add_box(&b->stale[i], &screen);
+	}
+
+	// There is always a free buffer, unless one is already waiting
+	int buf = b->queued;
+	if (buf >= 0)
+		stats_replaced();
+	else
+		buf = free_buffer(b);
+
+	auto dst = &b->buf[buf];
+	auto stale = &b->stale[buf];
+	auto bpp = pixfmt_bpp(fb->pixfmt);
+	region_clip(stale, &screen);
+	for (int i = 0; i < stale->nbox; i++) {
+		auto bx = &stale->box[i];
+		for (int32_t j = bx->x1; j < bx->x2; j++)
+			memcpy(dst->data+j*dst->pitch+bx->y1*bpp,
+			       fb->data+j*fb->pitch+bx->y1*bpp, (bx->y2-bx->y1)*bpp);
+	}
+	region_clear(stale);
+	double t1 = stats_now();
+	stats_record(PHASE_UPLOAD, t1-t0);
+	b->cursor_x = cursor_x;
+	b->cursor_y = cursor_y;
+
+	if (b->pending < 0) {
+		b->pending = buf;
+		stats_queued(t1);
+	} else {
+		if (b->queued < 0)
+			stats_waiting();
+		b->queued = buf;
+	}
+	update_status(b);
+	trace_end("headless_queue_frame", tr);
+	return 0;
+}
+
+static bool
+headless_set_cursor(struct backend *_b, struct fb *fb) {
+	return fb->width >= 0 && fb->height >= 0 &&
+	       (uint32_t)fb->width <= _b->cursor_w && (uint32_t)fb->height <= _b->cursor_h;
+}
+
+static struct fb *
+headless_new_fb(struct backend *_b, int purpose) {
+	(void)purpose;
+	auto ret = tmalloc(struct fb, 1);
+	if (!fb_alloc(ret, _b->w, _b->h, XRGB8888)) {
+		free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+static void
+headless_free_fb(struct backend *_b, struct fb *fb) {
+	fb_release(fb);
+	free(fb);
+}
+
+const struct backend_ops headless_ops = {
+	.setup = headless_setup,
+	.queue_frame = headless_queue_frame,
+	.set_cursor = headless_set_cursor,
+	.new_fb = headless_new_fb,
+	.free_fb = headless_free_fb,
+};
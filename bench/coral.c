@@ -0,0 +1,442 @@
+// Microbenchmarks of the hot paths, printed as JSON so runs can be diffed
+//
+// Every benchmark is run for a few rounds of at least ROUND_TIME seconds,
+// the median round is reported.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "blend.h"
+#include "object.h"
+#include "render.h"
+#include "region.h"
+#include "raster.h"
+#include "resample.h"
+#include "image.h"
+#include "scene.h"
+#include "interpolate.h"
+#include "synth.h"
+#include "tape.h"
+#include "arena.h"
+
+#define ROUNDS 5
+#define ROUND_TIME 0.2
+
+typedef void (*bench_fn)(void *ud);
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static bool first_result = true;
+
+// pixels is how many pixels one op touches, 0 if that doesn't apply
+static void bench(const char *name, bench_fn fn, void *ud, double pixels) {
+	double ns[ROUNDS];
+	fn(ud); // warm up caches and lazily built state
+	for (int r = 0; r < ROUNDS; r++) {
+		long iter = 0;
+		double start = now(), elapsed;
+		do {
+			fn(ud);
+			iter++;
+			elapsed = now()-start;
+		} while (elapsed < ROUND_TIME);
+		ns[r] = elapsed*1e9/iter;
+	}
+	qsort(ns, ROUNDS, sizeof(double), cmp_double);
+
+	double med = ns[ROUNDS/2];
+	printf("%s\n    { \"name\": \"%s\", \"ns_per_op\": %.1f, \"min_ns_per_op\": %.1f",
+	       first_result ? "" : ",", name, med, ns[0]);
+	if (pixels > 0)
+		printf(", \"pixels_per_sec\": %.0f", pixels*1e9/med);
+	printf(" }");
+	first_result = false;
+}
+
+// Translucent premultiplied pixels
+static void fill_translucent(struct fb *fb) {
+	uint32_t seed = 1;
+	for (int32_t i = 0; i < fb->height; i++) {
+		auto row = (uint32_t *)(fb->data+i*fb->pitch);
+		for (int32_t j = 0; j < fb->width; j++) {
+			seed = seed*1103515245+12345;
+			uint32_t a = 1+(seed>>16)%254;
+			uint32_t c = (seed>>8)&0xff;
+			c = c*a/255;
+			row[j] = a<<24 | c<<16 | c<<8 | c;
+		}
+	}
+}
+
+struct blit_args {
+	struct fb *dst, *src;
+};
+
+static void run_blit(void *ud) {
+	struct blit_args *a = ud;
+	blit(a->dst, a->src, 0, 0);
+}
+
+struct row_args {
+	blend_row_fn fn;
+	struct fb *dst, *src;
+};
+
+static void run_rows(void *ud) {
+	struct row_args *a = ud;
+	for (int32_t i = 0; i < a->dst->height; i++)
+		a->fn((uint32_t *)(a->dst->data+i*a->dst->pitch),
+		      (const uint32_t *)(a->src->data+i*a->src->pitch), a->dst->width);
+}
+
+static void copy_row(uint32_t *restrict dst, const uint32_t *restrict src, size_t n) {
+	memcpy(dst, src, n*sizeof(*dst));
+}
+
+struct object_args {
+	struct object *o;
+	struct fb *target;
+};
+
+// Both render() and compositing, as if the object changed every frame
+static void run_object(void *ud) {
+	struct object_args *a = ud;
+	auto o = a->o;
+	o->render(o);
+	if (o->draw)
+		o->draw(o, a->target, &o->drawn);
+	else
+		blit_clipped(a->target, &o->fb, o->drawn.x1, o->drawn.y1, &o->drawn);
+}
+
+static struct object_args
+setup_object(struct object *o, struct fb *target) {
+	int32_t x = V(o->x), y = V(o->y), w = V(o->w), h = V(o->h);
+	if (!o->draw)
+		fb_alloc(&o->fb, w, h, o->fb.pixfmt);
+	o->drawn = (struct box){ x, y, x+h, y+w };
+	return (struct object_args){ o, target };
+}
+
+struct raster_args {
+	struct coverage cov;
+	struct shape outer, inner;
+	int32_t w, h;
+};
+
+static void run_raster(void *ud) {
+	struct raster_args *a = ud;
+	raster_shape(&a->cov, a->w, a->h, &a->outer, a->inner.hw > 0 ? &a->inner : NULL);
+}
+
+struct resample_args {
+	struct fb *src, dst;
+};
+
+static void run_resample_hq(void *ud) {
+	struct resample_args *a = ud;
+	auto e = resample_get(a->src, a->dst.width, a->dst.height, RESAMPLE_HQ);
+	resample_put(e);
+	resample_forget(a->src);
+}
+
+static void run_resample_cached(void *ud) {
+	struct resample_args *a = ud;
+	resample_put(resample_get(a->src, a->dst.width, a->dst.height, RESAMPLE_HQ));
+}
+
+static void run_resample_bilinear(void *ud) {
+	struct resample_args *a = ud;
+	resample_bilinear(&a->dst, a->src);
+}
+
+struct premultiply_args {
+	struct fb *dst;
+	uint8_t *rgba;
+};
+
+static void run_premultiply(void *ud) {
+	struct premultiply_args *a = ud;
+	premultiply_image(a->dst, a->rgba);
+}
+
+static void run_advance(void *ud) {
+	interpolate_man_advance(ud, 1e-6);
+}
+
+struct chain_args {
+	struct interpolate_man *im;
+	var *top;
+};
+
+static void run_chain(void *ud) {
+	struct chain_args *a = ud;
+	interpolate_man_advance(a->im, 1e-6);
+	V(a->top);
+	C(a->top);
+}
+
+struct pick_args {
+	struct scene *s;
+	uint32_t seed;
+	int32_t w, h;
+};
+
+static void run_pick(void *ud) {
+	struct pick_args *a = ud;
+	a->seed = a->seed*1103515245+12345;
+	uint32_t x = (a->seed>>8)%a->h;
+	a->seed = a->seed*1103515245+12345;
+	uint32_t y = (a->seed>>8)%a->w;
+	get_object_at(a->s, x, y);
+}
+
+static void bench_blit(struct fb *screen) {
+	struct fb xrgb = {0}, argb = {0};
+	fb_alloc(&xrgb, screen->width, screen->height, XRGB8888);
+	fb_alloc(&argb, screen->width, screen->height, ARGB8888);
+	fill_translucent(&argb);
+	double px = (double)screen->width*screen->height;
+
+	bench("blit/xrgb/1080p", run_blit, &(struct blit_args){ screen, &xrgb }, px);
+	bench("blit/argb/1080p", run_blit, &(struct blit_args){ screen, &argb }, px);
+
+	fb_release(&xrgb);
+	fb_release(&argb);
+}
+
+// The row kernels behind blit(), one by one
+static void bench_blend(void) {
+	static const struct {
+		const char *name;
+		int32_t w, h;
+	} sizes[] = {
+		{ "1080p", 1920, 1080 },
+		{ "4K",    3840, 2160 },
+	};
+	for (size_t i = 0; i < ARR_LEN(sizes); i++) {
+		struct fb dst = {0}, src = {0};
+		fb_alloc(&dst, sizes[i].w, sizes[i].h, XRGB8888);
+		fb_alloc(&src, sizes[i].w, sizes[i].h, ARGB8888);
+		memset(dst.data, 0x80, dst.pitch*dst.height);
+		fill_translucent(&src);
+		double px = (double)sizes[i].w*sizes[i].h;
+
+		char name[64];
+		snprintf(name, sizeof(name), "blend/memcpy/%s", sizes[i].name);
+		bench(name, run_rows, &(struct row_args){ copy_row, &dst, &src }, px);
+		for (auto k = blend_kernels; k->name; k++) {
+			if (!k->supported())
+				continue;
+			snprintf(name, sizeof(name), "blend/%s/%s", k->name, sizes[i].name);
+			bench(name, run_rows, &(struct row_args){ k->over, &dst, &src }, px);
+		}
+		fb_release(&dst);
+		fb_release(&src);
+	}
+}
+
+static void bench_shapes(struct fb *screen) {
+	auto opaque = new_rect(vC(100), vC(100), vC(512), vC(512),
+	                       vC(255), vC(0), vC(0), vC(255));
+	auto a = setup_object(opaque, screen);
+	bench("render_rect/opaque/512", run_object, &a, 512*512);
+
+	auto translucent = new_rect(vC(100), vC(100), vC(512), vC(512),
+	                            vC(0), vC(255), vC(0), vC(128));
+	a = setup_object(translucent, screen);
+	bench("render_rect/translucent/512", run_object, &a, 512*512);
+
+	auto circle = new_circle(vC(100), vC(100), vC(512), vC(512),
+	                         vC(255), vC(255), vC(255), vC(255), vC(0));
+	a = setup_object(circle, screen);
+	bench("render_circle/filled/512", run_object, &a, 512*512);
+
+	auto ring = new_circle(vC(100), vC(100), vC(512), vC(512),
+	                       vC(255), vC(255), vC(255), vC(255), vC(4));
+	a = setup_object(ring, screen);
+	bench("render_circle/ring/512", run_object, &a, 512*512);
+
+	// What render_circle() skips when only the colour changes
+	struct raster_args r = {
+		.outer = { SHAPE_ELLIPSE, 256, 256, 0 },
+		.w = 512,
+		.h = 512,
+	};
+	bench("raster/circle/512", run_raster, &r, 512*512);
+	r.inner = (struct shape){ SHAPE_ELLIPSE, 252, 252, 0 };
+	bench("raster/ring/512", run_raster, &r, 512*512);
+	coverage_fini(&r.cov);
+}
+
+static void bench_scale(struct fb *screen) {
+	struct fb src = {0};
+	fb_alloc(&src, 1024, 1024, ARGB8888);
+	fill_translucent(&src);
+
+	struct resample_args a = { .src = &src };
+	fb_alloc(&a.dst, 600, 600, ARGB8888);
+	bench("render_scale/hq/1024->600", run_resample_hq, &a, 600*600);
+	bench("render_scale/cached/1024->600", run_resample_cached, &a, 600*600);
+	bench("render_scale/bilinear/1024->600", run_resample_bilinear, &a, 600*600);
+
+	auto scale = new_scale(vC(0), vC(0), vC(600), vC(600), &src);
+	auto o = setup_object(scale, screen);
+	bench("render_scale/object/600", run_object, &o, 600*600);
+
+	fb_release(&a.dst);
+}
+
+static void bench_premultiply(void) {
+	struct fb dst = {0};
+	fb_alloc(&dst, 1920, 1080, ARGB8888);
+	uint8_t *rgba = malloc(1920*1080*4);
+	for (size_t i = 0; i < 1920*1080*4; i++)
+		rgba[i] = i*2654435761u>>24;
+	bench("premultiply/1080p", run_premultiply,
+	      &(struct premultiply_args){ &dst, rgba }, 1920*1080);
+	free(rgba);
+	fb_release(&dst);
+}
+
+static void bench_advance(void) {
+	static const int counts[] = { 10000, 100000 };
+	for (size_t i = 0; i < ARR_LEN(counts); i++) {
+		auto im = interpolate_man_new();
+		for (int j = 0; j < counts[i]; j++) {
+			auto v = new_keyed(im, j);
+			// Long enough to never finish during the benchmark
+			keyed_new_linear_key((void *)v, -j, 1e9, NULL, NULL);
+		}
+		char name[64];
+		snprintf(name, sizeof(name), "interpolate_man_advance/%d", counts[i]);
+		bench(name, run_advance, im, 0);
+	}
+}
+
+// Every level uses the one below twice, 2^depth paths from the top
+static void bench_chain(void) {
+	static const int depths[] = { 8, 16 };
+	for (size_t i = 0; i < ARR_LEN(depths); i++) {
+		auto im = interpolate_man_new();
+		auto v = new_keyed(im, 0);
+		keyed_new_linear_key((void *)v, 1, 1e9, NULL, NULL);
+		for (int j = 0; j < depths[i]; j++)
+			v = vADD(v, new_arith(MUL, v, vC(0.5)));
+		char name[64];
+		snprintf(name, sizeof(name), "var_chain/%d", depths[i]);
+		bench(name, run_chain, &(struct chain_args){ im, v }, 0);
+	}
+}
+
+static void bench_pick(void) {
+	static const int counts[] = { 1000, 10000 };
+	for (size_t i = 0; i < ARR_LEN(counts); i++) {
+		auto s = new_scene(4);
+		uint32_t seed = 7;
+		for (int j = 0; j < counts[i]; j++) {
+			seed = seed*1103515245+12345;
+			double x = (seed>>8)%1080;
+			seed = seed*1103515245+12345;
+			double y = (seed>>8)%1920;
+			auto o = new_ghost(vC(x), vC(y), vC(32), vC(32), NULL);
+			list_add_tail(&o->siblings, &s->layer[j%s->nlayers]);
+		}
+		char name[64];
+		snprintf(name, sizeof(name), "get_object_at/%d", counts[i]);
+		bench(name, run_pick, &(struct pick_args){ s, 1, 1920, 1080 }, 0);
+	}
+}
+
+struct frame_args {
+	struct interpolate_man *im;
+	struct scene *s;
+	struct fb *target;
+};
+
+// One frame of the main loop, at 60Hz
+static void run_frame(void *ud) {
+	struct frame_args *a = ud;
+	interpolate_man_advance(a->im, 1/60.0);
+	render_scene(a->target, a->s);
+}
+
+static void bench_synth(struct fb *screen) {
+	static const int counts[] = { 100, 1000, 5000 };
+	for (size_t i = 0; i < ARR_LEN(counts); i++) {
+		struct synth_params p;
+		synth_params_default(&p);
+		p.nobjects = counts[i];
+		auto prev = arena_set_current(arena_new());
+		auto im = interpolate_man_new();
+		auto s = build_synth_scene(im, &p, screen->width, screen->height);
+		arena_set_current(prev);
+		scene_track_deps(s);
+		tape_compile(s);
+		char name[64];
+		snprintf(name, sizeof(name), "render_scene/synth/%d", counts[i]);
+		bench(name, run_frame, &(struct frame_args){ im, s, screen }, 0);
+		scene_free(s);
+	}
+}
+
+struct rebuild_args {
+	struct synth_params p;
+	struct fb *target;
+};
+
+// A whole scene lifetime: build, one frame, tear down
+static void run_rebuild(void *ud) {
+	struct rebuild_args *a = ud;
+	auto prev = arena_set_current(arena_new());
+	auto im = interpolate_man_new();
+	auto s = build_synth_scene(im, &a->p, a->target->width, a->target->height);
+	arena_set_current(prev);
+	scene_track_deps(s);
+	tape_compile(s);
+	interpolate_man_advance(im, 1/60.0);
+	render_scene(a->target, s);
+	scene_free(s);
+}
+
+static void bench_rebuild(struct fb *screen) {
+	struct rebuild_args a = { .target = screen };
+	synth_params_default(&a.p);
+	a.p.nobjects = 1000;
+	bench("scene_rebuild/synth/1000", run_rebuild, &a, 0);
+}
+
+int main() {
+	blend_init();
+	struct fb screen = {0};
+	fb_alloc(&screen, 1920, 1080, XRGB8888);
+	memset(screen.data, 0x80, screen.pitch*screen.height);
+
+	printf("{\n  \"blend_kernel\": \"%s\",\n  \"results\": [", blend->name);
+	bench_blit(&screen);
+	bench_blend();
+	bench_shapes(&screen);
+	bench_scale(&screen);
+	bench_premultiply();
+	bench_advance();
+	bench_chain();
+	bench_pick();
+	bench_synth(&screen);
+	bench_rebuild(&screen);
+	printf("\n  ]\n}\n");
+
+	fb_release(&screen);
+	return 0;
+}
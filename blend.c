@@ -0,0 +1,245 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLEND_X86
+#endif
+
+#include "common.h"
+#include "blend.h"
+
+static inline uint32_t over_px(uint32_t d, uint32_t s) {
+	uint32_t ia = 255-(s>>24);
+	return s+mul_div255_2x(d, ia)+(mul_div255_2x(d>>8, ia)<<8);
+}
+
+static bool scalar_supported(void) {
+	return true;
+}
+
+static void
+scalar_over(uint32_t *restrict dst, const uint32_t *restrict src, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		uint32_t s = src[i], a = s>>24;
+		if (!a)
+			continue;
+		dst[i] = a == 255 ? s : over_px(dst[i], s);
+	}
+}
+
+static void
+scalar_fill(uint32_t *restrict dst, uint32_t px, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		dst[i] = px;
+}
+
+static void
+scalar_over_solid(uint32_t *restrict dst, uint32_t px, size_t n) {
+	uint32_t a = px>>24;
+	if (!a)
+		return;
+	if (a == 255) {
+		scalar_fill(dst, px, n);
+		return;
+	}
+	for (size_t i = 0; i < n; i++)
+		dst[i] = over_px(dst[i], px);
+}
+
+#ifdef BLEND_X86
+static bool sse2_supported(void) {
+	return __builtin_cpu_supports("sse2");
+}
+
+static bool avx2_supported(void) {
+	return __builtin_cpu_supports("avx2");
+}
+
+// (x+128 + (x+128)>>8)>>8 on 16-bit lanes, x <= 255*255
+#define DIV255_EPI16(pfx, x) \
+	pfx##_srli_epi16(pfx##_add_epi16(x, pfx##_srli_epi16(x, 8)), 8)
+
+__attribute__((target("sse2")))
+static void
+sse2_over(uint32_t *restrict dst, const uint32_t *restrict src, size_t n) {
+	const __m128i zero = _mm_setzero_si128(),
+	              amask = _mm_set1_epi32(0xff000000),
+	              c255 = _mm_set1_epi16(255),
+	              c128 = _mm_set1_epi16(128);
+	size_t i = 0;
+	for (; i+4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src+i));
+		__m128i sa = _mm_and_si128(s, amask);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, zero)) == 0xffff)
+			continue;
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, amask)) == 0xffff) {
+			_mm_storeu_si128((__m128i *)(dst+i), s);
+			continue;
+		}
+
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst+i));
+		// 255-alpha replicated into every 16-bit lane of its pixel
+		__m128i ia = _mm_srli_epi32(s, 24);
+		ia = _mm_sub_epi16(c255, _mm_or_si128(ia, _mm_slli_epi32(ia, 16)));
+		__m128i ialo = _mm_unpacklo_epi32(ia, ia),
+		        iahi = _mm_unpackhi_epi32(ia, ia);
+
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), ialo),
+		        hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), iahi);
+		lo = _mm_add_epi16(lo, c128);
+		hi = _mm_add_epi16(hi, c128);
+		lo = DIV255_EPI16(_mm, lo);
+		hi = DIV255_EPI16(_mm, hi);
+		d = _mm_adds_epu8(_mm_packus_epi16(lo, hi), s);
+		_mm_storeu_si128((__m128i *)(dst+i), d);
+	}
+	scalar_over(dst+i, src+i, n-i);
+}
+
+__attribute__((target("sse2")))
+static void
+sse2_fill(uint32_t *restrict dst, uint32_t px, size_t n) {
+	const __m128i v = _mm_set1_epi32(px);
+	size_t i = 0;
+	for (; i+4 <= n; i += 4)
+		_mm_storeu_si128((__m128i *)(dst+i), v);
+	scalar_fill(dst+i, px, n-i);
+}
+
+__attribute__((target("sse2")))
+static void
+sse2_over_solid(uint32_t *restrict dst, uint32_t px, size_t n) {
+	uint32_t a = px>>24;
+	if (a == 0 || a == 255) {
+		if (a)
+			sse2_fill(dst, px, n);
+		return;
+	}
+
+	const __m128i zero = _mm_setzero_si128(),
+	              ia = _mm_set1_epi16(255-a),
+	              c128 = _mm_set1_epi16(128),
+	              s = _mm_set1_epi32(px);
+	size_t i = 0;
+	for (; i+4 <= n; i += 4) {
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst+i));
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), ia),
+		        hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), ia);
+		lo = _mm_add_epi16(lo, c128);
+		hi = _mm_add_epi16(hi, c128);
+		lo = DIV255_EPI16(_mm, lo);
+		hi = DIV255_EPI16(_mm, hi);
+		d = _mm_adds_epu8(_mm_packus_epi16(lo, hi), s);
+		_mm_storeu_si128((__m128i *)(dst+i), d);
+	}
+	scalar_over_solid(dst+i, px, n-i);
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_over(uint32_t *restrict dst, const uint32_t *restrict src, size_t n) {
+	const __m256i zero = _mm256_setzero_si256(),
+	              amask = _mm256_set1_epi32(0xff000000),
+	              c255 = _mm256_set1_epi16(255),
+	              c128 = _mm256_set1_epi16(128);
+	size_t i = 0;
+	for (; i+8 <= n; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src+i));
+		__m256i sa = _mm256_and_si256(s, amask);
+		if (_mm256_testz_si256(sa, sa))
+			continue;
+		if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, amask)) == 0xffffffff) {
+			_mm256_storeu_si256((__m256i *)(dst+i), s);
+			continue;
+		}
+
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst+i));
+		// unpack/pack work within 128-bit lanes, the same way for
+		// the pixels and for the alpha, so they stay lined up
+		__m256i ia = _mm256_srli_epi32(s, 24);
+		ia = _mm256_sub_epi16(c255, _mm256_or_si256(ia, _mm256_slli_epi32(ia, 16)));
+		__m256i ialo = _mm256_unpacklo_epi32(ia, ia),
+		        iahi = _mm256_unpackhi_epi32(ia, ia);
+
+		__m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), ialo),
+		        hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), iahi);
+		lo = _mm256_add_epi16(lo, c128);
+		hi = _mm256_add_epi16(hi, c128);
+		lo = DIV255_EPI16(_mm256, lo);
+		hi = DIV255_EPI16(_mm256, hi);
+		d = _mm256_adds_epu8(_mm256_packus_epi16(lo, hi), s);
+		_mm256_storeu_si256((__m256i *)(dst+i), d);
+	}
+	sse2_over(dst+i, src+i, n-i);
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_fill(uint32_t *restrict dst, uint32_t px, size_t n) {
+	const __m256i v = _mm256_set1_epi32(px);
+	size_t i = 0;
+	for (; i+8 <= n; i += 8)
+		_mm256_storeu_si256((__m256i *)(dst+i), v);
+	sse2_fill(dst+i, px, n-i);
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_over_solid(uint32_t *restrict dst, uint32_t px, size_t n) {
+	uint32_t a = px>>24;
+	if (a == 0 || a == 255) {
+		if (a)
+			avx2_fill(dst, px, n);
+		return;
+	}
+
+	const __m256i zero = _mm256_setzero_si256(),
+	              ia = _mm256_set1_epi16(255-a),
+	              c128 = _mm256_set1_epi16(128),
+	              s = _mm256_set1_epi32(px);
+	size_t i = 0;
+	for (; i+8 <= n; i += 8) {
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst+i));
+		__m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), ia),
+		        hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), ia);
+		lo = _mm256_add_epi16(lo, c128);
+		hi = _mm256_add_epi16(hi, c128);
+		lo = DIV255_EPI16(_mm256, lo);
+		hi = DIV255_EPI16(_mm256, hi);
+		d = _mm256_adds_epu8(_mm256_packus_epi16(lo, hi), s);
+		_mm256_storeu_si256((__m256i *)(dst+i), d);
+	}
+	sse2_over_solid(dst+i, px, n-i);
+}
+#endif
+
+const struct blend_kernel blend_kernels[] = {
+	{ "scalar", scalar_supported, scalar_over, scalar_fill, scalar_over_solid },
+#ifdef BLEND_X86
+	{ "sse2",   sse2_supported,   sse2_over,   sse2_fill,   sse2_over_solid },
+	{ "avx2",   avx2_supported,   avx2_over,   avx2_fill,   avx2_over_solid },
+#endif
+	{ NULL },
+};
+
+const struct blend_kernel *blend = &blend_kernels[0];
+
+void blend_init(void) {
+	const char *force = getenv("CORAL_BLEND");
+	const struct blend_kernel *best = &blend_kernels[0];
+	for (auto k = blend_kernels; k->name; k++) {
+		if (!k->supported())
+			continue;
+		if (force && strcmp(force, k->name) == 0) {
+			best = k;
+			break;
+		}
+		best = k;
+	}
+	blend = best;
+	fprintf(stderr, "Using %s blend kernel\n", blend->name);
+}
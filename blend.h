@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Row kernels operating on premultiplied ARGB8888 pixels, one uint32_t
+// per pixel (0xAARRGGBB in native byte order).
+
+// x*y/255, rounded, for two 8-bit channels packed in 0x00ff00ff lanes
+static inline uint32_t mul_div255_2x(uint32_t x, uint32_t y) {
+	uint32_t t = (x & 0x00ff00ff)*y+0x00800080;
+	return ((t+((t>>8) & 0x00ff00ff))>>8) & 0x00ff00ff;
+}
+
+// Every channel of px multiplied by a/255
+static inline uint32_t px_scale(uint32_t px, uint32_t a) {
+	return mul_div255_2x(px, a)|(mul_div255_2x(px>>8, a)<<8);
+}
+
+// dst = src + dst*(255-src.a)/255
+typedef void (*blend_row_fn)(uint32_t *restrict dst, const uint32_t *restrict src, size_t n);
+
+// dst = px, for n pixels
+typedef void (*blend_fill_fn)(uint32_t *restrict dst, uint32_t px, size_t n);
+
+struct blend_kernel {
+	const char *name;
+	bool (*supported)(void);
+	blend_row_fn over;
+	// Solid colour fill, and src-over of a solid colour
+	blend_fill_fn fill, over_solid;
+};
+
+// All kernels compiled in, ordered from slowest to fastest, terminated
+// by an entry with name == NULL
+extern const struct blend_kernel blend_kernels[];
+
+// The kernel used by blit(), scalar until blend_init() is called
+extern const struct blend_kernel *blend;
+
+// Pick the fastest kernel supported by this cpu. Setting CORAL_BLEND to
+// a kernel name forces that kernel instead.
+void blend_init(void);
@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "render.h"
+#include "fbpool.h"
+
+#define MIN_CLASS 12 // 4KiB
+#define NCLASSES (__builtin_ctz(FB_POOL_LARGE)-MIN_CLASS+1)
+#define LARGE_CLASS (-1)
+
+// Sits right in front of the pixels, FB_ALIGN bytes so they stay aligned
+struct fb_block {
+	struct fb_block *next;
+	size_t size; // usable bytes after the header
+	int cls;
+	bool mapped;
+};
+_Static_assert(sizeof(struct fb_block) <= FB_ALIGN, "fb_block too big");
+
+static struct {
+	struct fb_block *free[NCLASSES];
+	struct fb_block *large;
+	bool hugepages;
+	struct fb_pool_stats stats;
+} pool;
+
+static inline struct fb_block *block_of(uint8_t *data) {
+	return (void *)(data-FB_ALIGN);
+}
+
+static inline uint8_t *block_data(struct fb_block *b) {
+	return (uint8_t *)b+FB_ALIGN;
+}
+
+static inline int size_class(size_t size) {
+	if (size <= (1u<<MIN_CLASS))
+		return 0;
+	return 64-__builtin_clzll(size-1)-MIN_CLASS;
+}
+
+// block_get() rounds size so the mapping is whole huge pages
+static struct fb_block *map_large(size_t size) {
+	size_t len = FB_ALIGN+size;
+	assert(len%FB_POOL_LARGE == 0);
+	void *p = MAP_FAILED;
+	bool huge = false;
+#ifdef MAP_HUGETLB
+	if (pool.hugepages) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		huge = p != MAP_FAILED;
+	}
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		// Fall back to transparent huge pages
+		if (pool.hugepages)
+			huge = madvise(p, len, MADV_HUGEPAGE) == 0;
+#endif
+	}
+	if (huge)
+		pool.stats.huge++;
+
+	struct fb_block *b = p;
+	b->size = size;
+	b->cls = LARGE_CLASS;
+	b->mapped = true;
+	return b;
+}
+
+static void block_destroy(struct fb_block *b) {
+	if (b->mapped) {
+		if (munmap(b, FB_ALIGN+b->size) != 0)
+			fprintf(stderr, "Could not unmap fb block: %s\n", strerror(errno));
+	} else
+		free(b);
+}
+
+// Best fit, but don't waste more than a quarter of the block
+static struct fb_block *take_large(size_t size) {
+	struct fb_block **best = NULL;
+	for (auto p = &pool.large; *p; p = &(*p)->next)
+		if ((*p)->size >= size && (*p)->size-size <= (*p)->size/4 &&
+		    (!best || (*p)->size < (*best)->size))
+			best = p;
+	if (!best)
+		return NULL;
+
+	auto ret = *best;
+	*best = ret->next;
+	return ret;
+}
+
+static struct fb_block *block_get(size_t size) {
+	struct fb_block *b;
+	if (size > FB_POOL_LARGE) {
+		// The header goes in the last page too
+		size = (FB_ALIGN+size+FB_POOL_LARGE-1)/FB_POOL_LARGE*FB_POOL_LARGE-FB_ALIGN;
+		b = take_large(size);
+	} else {
+		int cls = size_class(size);
+		b = pool.free[cls];
+		if (b)
+			pool.free[cls] = b->next;
+	}
+
+	if (b) {
+		pool.stats.reused++;
+		pool.stats.cached -= b->size;
+	} else {
+		if (size > FB_POOL_LARGE)
+			b = map_large(size);
+		else {
+			int cls = size_class(size);
+			size_t bsize = (size_t)1<<(cls+MIN_CLASS);
+			b = aligned_alloc(FB_ALIGN, FB_ALIGN+bsize);
+			if (b) {
+				b->size = bsize;
+				b->cls = cls;
+				b->mapped = false;
+			}
+		}
+		if (!b)
+			return NULL;
+		pool.stats.fresh++;
+	}
+	pool.stats.in_use += b->size;
+	return b;
+}
+
+static void block_put(struct fb_block *b) {
+	pool.stats.in_use -= b->size;
+	pool.stats.released++;
+	if (pool.stats.cached+b->size > FB_POOL_MAX_CACHED) {
+		block_destroy(b);
+		return;
+	}
+
+	auto list = b->cls == LARGE_CLASS ? &pool.large : &pool.free[b->cls];
+	b->next = *list;
+	*list = b;
+	pool.stats.cached += b->size;
+}
+
+bool fb_alloc(struct fb *fb, int32_t w, int32_t h, enum pixfmt pixfmt) {
+	uint32_t pitch = w*pixfmt_bpp(pixfmt);
+	pitch = (pitch+FB_ALIGN-1)/FB_ALIGN*FB_ALIGN;
+	size_t size = (size_t)pitch*h;
+
+	auto b = block_get(size);
+	if (!b)
+		return false;
+	memset(block_data(b), 0, size);
+
+	fb->data = block_data(b);
+	fb->pitch = pitch;
+	fb->width = w;
+	fb->height = h;
+	fb->pixfmt = pixfmt;
+	fb->opaque = pixfmt == XRGB8888;
+	return true;
+}
+
+void fb_release(struct fb *fb) {
+	if (!fb->data)
+		return;
+	block_put(block_of(fb->data));
+	fb->data = NULL;
+}
+
+void fb_pool_use_hugepages(bool on) {
+	pool.hugepages = on;
+}
+
+void fb_pool_get_stats(struct fb_pool_stats *s) {
+	*s = pool.stats;
+}
+
+void fb_pool_dump_stats(FILE *f) {
+	auto s = &pool.stats;
+	uint64_t total = s->reused+s->fresh;
+	fprintf(f, "fb pool: %lu allocations, %lu reused (%.1f%%), %lu fresh "
+	        "(%lu huge), %lu released, %zu KiB in use, %zu KiB cached\n",
+	        total, s->reused, total ? 100.0*s->reused/total : 0.0, s->fresh,
+	        s->huge, s->released, s->in_use>>10, s->cached>>10);
+}
+
+void fb_pool_trim(void) {
+	for (int i = 0; i < NCLASSES; i++) {
+		while (pool.free[i]) {
+			auto next = pool.free[i]->next;
+			block_destroy(pool.free[i]);
+			pool.free[i] = next;
+		}
+	}
+	while (pool.large) {
+		auto next = pool.large->next;
+		block_destroy(pool.large);
+		pool.large = next;
+	}
+	pool.stats.cached = 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Pixel storage for struct fb comes from this pool, see fb_alloc() and
+// fb_release() in render.h. Rows start on FB_ALIGN byte boundaries.
+//
+// Small buffers are rounded up to power of two size classes. Buffers over
+// FB_POOL_LARGE bytes (screen sized ones) are mmap'd, optionally with huge
+// page backing, and rounded up so the mapping is whole huge pages.
+// Released buffers are kept for reuse, up to FB_POOL_MAX_CACHED bytes.
+//
+// The pool is not thread safe.
+
+#define FB_ALIGN 64
+#define FB_POOL_LARGE (2u<<20)
+#define FB_POOL_MAX_CACHED (256u<<20)
+
+struct fb_pool_stats {
+	uint64_t reused;   // allocations served from a free list
+	uint64_t fresh;    // allocations that needed new memory
+	uint64_t released;
+	uint64_t huge;     // fresh allocations backed by huge pages
+	size_t in_use, cached; // bytes
+};
+
+void fb_pool_use_hugepages(bool);
+void fb_pool_get_stats(struct fb_pool_stats *);
+void fb_pool_dump_stats(FILE *);
+// Give all cached buffers back to the system
+void fb_pool_trim(void);
@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "common.h"
+#include "backend.h"
+#include "stats.h"
+#include "frame_sched.h"
+
+// Until the first two flips have been seen
+#define DEFAULT_PERIOD (1/60.0)
+
+void sched_init(struct sched *s) {
+	*s = (struct sched){
+		.margin = 0.002,
+	};
+}
+
+static double refresh_period(struct sched *s, const struct backend *b) {
+	if (b->flip_seq != s->last_flip_seq) {
+		if (s->last_flip_seq && b->flip_seq > s->last_flip_seq) {
+			double p = (b->flip_time-s->last_flip_time)/(b->flip_seq-s->last_flip_seq);
+			// Smooth out timestamp jitter
+			s->refresh_period = s->refresh_period ? s->refresh_period*0.9+p*0.1 : p;
+		}
+		s->last_flip_seq = b->flip_seq;
+		s->last_flip_time = b->flip_time;
+	}
+	return s->refresh_period ? s->refresh_period : DEFAULT_PERIOD;
+}
+
+// The first vblank after the last flip that hasn't passed yet
+static double next_vblank(const struct backend *b, double now, double period) {
+	if (!b->flip_seq)
+		return now+period;
+	double next = b->flip_time+period;
+	if (next < now)
+		next += ceil((now-next)/period)*period;
+	return next;
+}
+
+// The slowest of the recent frames, being a little late costs a whole
+// refresh, being early only a little latency
+static double frame_cost(const struct sched *s) {
+	double max = 0;
+	for (int i = 0; i < s->ncost; i++)
+		if (s->cost[i] > max)
+			max = s->cost[i];
+	return max;
+}
+
+double sched_delay(struct sched *s, const struct backend *b) {
+	double period = refresh_period(s, b);
+	if (s->asap || !s->ncost)
+		return 0;
+	double budget = frame_cost(s)+s->margin;
+	// Can't keep up, go as fast as we can
+	if (budget >= period)
+		return 0;
+
+	// Frames already committed go out first. Being queued behind them
+	// makes the same vblank as being committed after them, but starts
+	// earlier.
+	double now = stats_now();
+	double start = next_vblank(b, now, period)+period*b->in_flight-budget;
+	// Too late for that vblank, aim for the one after
+	if (start < now)
+		start += period;
+	return start-now;
+}
+
+double sched_present(struct sched *s, const struct backend *b) {
+	double period = refresh_period(s, b);
+	double now = stats_now();
+	double next = next_vblank(b, now, period);
+	// Won't be ready in time, and by then the committed frames are out
+	if (s->ncost && next-now < frame_cost(s))
+		return next+period;
+	return next+period*b->in_flight;
+}
+
+void sched_frame_cost(struct sched *s, double seconds) {
+	s->cost[s->next] = seconds;
+	s->next = (s->next+1)%SCHED_WINDOW;
+	if (s->ncost < SCHED_WINDOW)
+		s->ncost++;
+}
+
+void sched_dump(struct sched *s, FILE *f) {
+	fprintf(f, "schedule: %s, refresh %.3fms, frame cost %.3fms, margin %.3fms\n",
+	        s->asap ? "asap" : "deadline",
+	        (s->refresh_period ? s->refresh_period : DEFAULT_PERIOD)*1e3,
+	        frame_cost(s)*1e3, s->margin*1e3);
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Decides when to start rendering a frame. Rendering right after a flip
+// samples the pointer and animations almost a whole refresh before they
+// are shown, so frames are started as late as they can be while still
+// making the next vblank: vblanks are predicted from page flip timestamps,
+// and how long a frame takes from the last SCHED_WINDOW frames.
+
+#define SCHED_WINDOW 32
+
+struct backend;
+
+struct sched {
+	// Start every frame right away, like before there was a schedule
+	bool asap;
+	// Seconds kept spare on top of the frame cost, for timer wakeup
+	// and the commit reaching the kernel
+	double margin;
+
+	// Time between vblanks, measured from page flips, and the flip it
+	// was last measured at
+	double refresh_period;
+	uint64_t last_flip_seq;
+	double last_flip_time;
+
+	// Seconds from starting a frame to it being queued
+	double cost[SCHED_WINDOW];
+	int ncost, next;
+};
+
+void sched_init(struct sched *);
+// Seconds from now until the next frame should start, 0 if it should
+// start now
+double sched_delay(struct sched *, const struct backend *);
+// When a frame started now will reach the screen. Animations are sampled
+// at this time rather than at the time they are rendered.
+double sched_present(struct sched *, const struct backend *);
+// A frame took that many seconds from start to being queued
+void sched_frame_cost(struct sched *, double seconds);
+void sched_dump(struct sched *, FILE *);
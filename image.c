@@ -4,8 +4,27 @@
 #include <stb_image.h>
 
 #include "render.h"
+#include "image.h"
 #include "common.h"
 
+bool premultiply_image(struct fb *dst, const uint8_t *rgba) {
+	// Premultiply alpha channel, while moving the pixels into the
+	// pool's padded rows
+	bool opaque = true;
+	for(int32_t i = 0; i < dst->height; i++) {
+		const uint8_t *src = rgba+i*dst->width*4;
+		uint8_t *d = dst->data+i*dst->pitch;
+		for(int32_t j = 0; j < dst->width; j++) {
+			d[j*4] = src[j*4]*src[j*4+3]/255.0;
+			d[j*4+1] = src[j*4+1]*src[j*4+3]/255.0;
+			d[j*4+2] = src[j*4+2]*src[j*4+3]/255.0;
+			d[j*4+3] = src[j*4+3];
+			opaque = opaque && src[j*4+3] == 255;
+		}
+	}
+	return opaque;
+}
+
 struct fb *load_image(const char *filename) {
 	FILE *f = fopen(filename, "r");
 	if (!f)
@@ -14,19 +33,17 @@ struct fb *load_image(const char *filename) {
 	auto img = stbi_load_from_callbacks(&stbi__stdio_callbacks, f, &x, &y, &c, 4);
 	fclose(f);
 
-	auto a = tmalloc(struct fb, 1);
-	a->height = y;
-	a->width = x;
-	a->pixfmt = XRGB8888;
-	a->pitch = x*pixfmt_bpp(a->pixfmt);
-	a->data = img;
-
-	// Premultiply alpha channel
-	for(int32_t i = 0; i < a->height*a->width; i++) {
-		a->data[i*4] *= a->data[i*4+3]/255.0;
-		a->data[i*4+1] *= a->data[i*4+3]/255.0;
-		a->data[i*4+2] *= a->data[i*4+3]/255.0;
+	if (!img)
+		return NULL;
+
+	auto a = new_fb(x, y, ARGB8888);
+	if (!a) {
+		stbi_image_free(img);
+		return NULL;
 	}
 
+	a->opaque = premultiply_image(a, img);
+	stbi_image_free(img);
+
 	return a;
 }
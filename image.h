@@ -1,4 +1,9 @@
 #pragma once
+#include <stdint.h>
+#include <stdbool.h>
 
 struct fb;
 struct fb *load_image(const char *);
+// Copy tightly packed RGBA pixels into dst, premultiplying them. Returns
+// whether they are all opaque.
+bool premultiply_image(struct fb *dst, const uint8_t *rgba);
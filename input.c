@@ -8,6 +8,7 @@
 #include "coral.h"
 #include "input.h"
 #include "common.h"
+#include "trace.h"
 
 struct libinput_input {
 	struct input base;
@@ -62,6 +63,13 @@ static void process_events(ev_io_libinput *w) {
 				lii->cursor_y += dy;
 			if (i->mouse_move_cb)
 				i->mouse_move_cb(lii->cursor_y, lii->cursor_x, i->user_data);
+		} else if (libinput_event_get_type(ev) == LIBINPUT_EVENT_POINTER_BUTTON) {
+			auto pt = libinput_event_get_pointer_event(ev);
+			bool pressed = libinput_event_pointer_get_button_state(pt) ==
+			               LIBINPUT_BUTTON_STATE_PRESSED;
+			if (i->mouse_button_cb)
+				i->mouse_button_cb(libinput_event_pointer_get_button(pt),
+				                   lii->kbstate, pressed, i->user_data);
 		} else if (libinput_event_get_type(ev) == LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE) {
 			auto pt = libinput_event_get_pointer_event(ev);
 			uint32_t ax = libinput_event_pointer_get_absolute_x(pt),
@@ -78,13 +86,21 @@ static void process_events(ev_io_libinput *w) {
 
 static void input_cb(EV_P_ ev_io *_w, int revent) {
 	ev_io_libinput *w = (void*)_w;
+	uint64_t t = trace_begin();
 	libinput_dispatch(w->libinput);
 	process_events(w);
+	trace_end("libinput_dispatch", t);
 }
 struct input *setup_libinput(EV_P, struct udev *u, uint32_t w, uint32_t h) {
 	auto li = libinput_udev_create_context(
 	    (struct libinput_interface[]){{open_restricted, close_restricted}}, NULL, u);
-	libinput_udev_assign_seat(li, "seat0");
+	if (!li)
+		return NULL;
+	if (libinput_udev_assign_seat(li, "seat0") < 0) {
+		fprintf(stderr, "Could not assign seat0\n");
+		libinput_unref(li);
+		return NULL;
+	}
 
 	auto lii =  tmalloc(struct libinput_input, 1);
 	auto iw = tmalloc(ev_io_libinput, 1);
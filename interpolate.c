@@ -4,131 +4,474 @@
 #include <stdbool.h>
 #include <math.h>
 #include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INTERPOLATE_X86
+#endif
+
 #include "list.h"
 #include "interpolate.h"
 #include "common.h"
+#include "arena.h"
+#include "trace.h"
+
+enum curve {
+	CURVE_LINEAR,
+	CURVE_QUADRATIC,
+	NCURVES,
+};
 
-struct key_frame;
 struct key_frame {
 	double elapsed;
 	double duration;
 	double setpoint;
 	key_cb callback;
-	void (*advance)(keyed *i, struct key_frame *k, double dt);
+	enum curve curve;
 	void *ud;
 	struct key_frame *next;
 };
 
+// The vars whose first key frame has the same curve, structure of arrays,
+// so they can all be advanced in one vectorized loop. Index i is the var
+// owner[i], with its first key frame's setpoint and duration, and the
+// time that key frame started.
+struct keyed_batch {
+	enum curve curve;
+	int n, cap;
+	double *current, *last_setpoint, *setpoint, *start, *duration;
+	keyed **owner;
+};
+
 struct keyed_var {
 	struct var base;
-	bool changed;
+	struct interpolate_man *im;
+	// Where current and last_setpoint live while the var has key frames,
+	// NULL when it's idle and they are kept below
+	struct keyed_batch *batch;
+	int index;
 	double current;
 	double last_setpoint;
+	// Value of im->tick when the var last stopped moving
+	uint64_t changed_tick;
 	struct key_frame *keys, **last_key;
+	// Callbacks of finished key frames are running, keyed_expire()
+	// starts whatever key frames they add
+	bool expiring;
+};
+
+// Key frames come from slabs of this many, and go back to a free list
+#define KEYS_PER_SLAB 64
+
+struct key_slab {
+	struct key_slab *next;
+	struct key_frame key[KEYS_PER_SLAB];
 };
 
 struct interpolate_man {
 	struct list_head interpolatables;
+	struct key_slab *slabs;
+	struct key_frame *free_keys;
+	struct interpolate_stats stats;
+	struct keyed_batch batch[NCURVES];
+	void (*advance_batch)(struct keyed_batch *, double now);
+	// Time of the last advance. Key frames are sampled at an absolute
+	// time, so there is no error to build up from frame to frame.
+	double now;
+	uint64_t tick;
+	// Called when an idle var gets a key frame
+	void (*wake)(void *ud);
+	void *wake_ud;
+	// Scratch space for vars that reached the end of a key frame, and
+	// for the ones that stopped moving
+	keyed **expired, **stopped;
+	int nexpired, expired_cap;
+	int nstopped, stopped_cap;
 };
 
-void linear_advance(keyed *i, struct key_frame *k, double dt) {
-	double d = (k->setpoint-i->last_setpoint)/k->duration*dt;
-	i->changed = true;
-	i->current += d;
-	fprintf(stderr, "curr %lf\n", i->current);
+// Where a key frame is after u of its duration, 0 <= u <= 1
+static inline double curve_shape(enum curve c, double u) {
+	// Quadratic eases out, it starts at twice the linear speed and stops
+	return c == CURVE_QUADRATIC ? u*(2-u) : u;
+}
+
+static inline double
+curve_sample(enum curve c, double from, double to, double elapsed, double duration) {
+	double u = elapsed >= duration ? 1 : elapsed/duration;
+	return from+(to-from)*curve_shape(c, u);
+}
+
+static void batch_advance_range(struct keyed_batch *b, int from, double now) {
+	for (int i = from; i < b->n; i++)
+		b->current[i] = curve_sample(b->curve, b->last_setpoint[i], b->setpoint[i],
+		                             now-b->start[i], b->duration[i]);
+}
+
+static void batch_advance_scalar(struct keyed_batch *b, double now) {
+	batch_advance_range(b, 0, now);
+}
+
+#ifdef INTERPOLATE_X86
+// Same arithmetic as the scalar version, two vars at a time. SSE2 is
+// wide enough, advancing is bound by memory long before it's bound by
+// the arithmetic.
+__attribute__((target("sse2")))
+static void batch_advance_sse2(struct keyed_batch *b, double now) {
+	const __m128d vnow = _mm_set1_pd(now), one = _mm_set1_pd(1), two = _mm_set1_pd(2);
+	bool quadratic = b->curve == CURVE_QUADRATIC;
+	int i = 0;
+	for (; i+2 <= b->n; i += 2) {
+		__m128d e = _mm_sub_pd(vnow, _mm_loadu_pd(b->start+i)),
+		        d = _mm_loadu_pd(b->duration+i);
+		__m128d done = _mm_cmpge_pd(e, d);
+		__m128d u = _mm_or_pd(_mm_and_pd(done, one), _mm_andnot_pd(done, _mm_div_pd(e, d)));
+		if (quadratic)
+			u = _mm_mul_pd(u, _mm_sub_pd(two, u));
+		__m128d from = _mm_loadu_pd(b->last_setpoint+i),
+		        to = _mm_loadu_pd(b->setpoint+i);
+		__m128d cur = _mm_add_pd(from, _mm_mul_pd(_mm_sub_pd(to, from), u));
+		_mm_storeu_pd(b->current+i, cur);
+	}
+	batch_advance_range(b, i, now);
+}
+#endif
+
+static void batch_grow(struct keyed_batch *b) {
+	b->cap = b->cap ? b->cap*2 : 64;
+	b->current = realloc(b->current, sizeof(double)*b->cap);
+	b->last_setpoint = realloc(b->last_setpoint, sizeof(double)*b->cap);
+	b->setpoint = realloc(b->setpoint, sizeof(double)*b->cap);
+	b->start = realloc(b->start, sizeof(double)*b->cap);
+	b->duration = realloc(b->duration, sizeof(double)*b->cap);
+	b->owner = realloc(b->owner, sizeof(keyed *)*b->cap);
+}
+
+// Start moving i towards its first key frame, which started at start
+static void keyed_activate(keyed *i, double start) {
+	auto k = i->keys;
+	auto b = &i->im->batch[k->curve];
+	if (b->n == b->cap)
+		batch_grow(b);
+	int idx = b->n++;
+	b->last_setpoint[idx] = i->last_setpoint;
+	b->setpoint[idx] = k->setpoint;
+	b->start[idx] = start;
+	b->duration[idx] = k->duration;
+	b->current[idx] = curve_sample(k->curve, i->last_setpoint, k->setpoint,
+	                               i->im->now-start, k->duration);
+	b->owner[idx] = i;
+	i->batch = b;
+	i->index = idx;
+}
+
+// Take i out of its batch, its state goes back into i
+static void keyed_deactivate(keyed *i) {
+	auto b = i->batch;
+	int idx = i->index;
+	i->current = b->current[idx];
+	i->last_setpoint = b->last_setpoint[idx];
+	if (i->keys)
+		i->keys->elapsed = i->im->now-b->start[idx];
+
+	int last = --b->n;
+	if (idx != last) {
+		b->current[idx] = b->current[last];
+		b->last_setpoint[idx] = b->last_setpoint[last];
+		b->setpoint[idx] = b->setpoint[last];
+		b->start[idx] = b->start[last];
+		b->duration[idx] = b->duration[last];
+		b->owner[idx] = b->owner[last];
+		b->owner[idx]->index = idx;
+	}
+	i->batch = NULL;
+	i->changed_tick = i->im->tick;
+
+	// Stopping at the end of a key frame is a change too
+	auto im = i->im;
+	if (i->base.ndependents) {
+		if (im->nstopped == im->stopped_cap) {
+			im->stopped_cap = im->stopped_cap ? im->stopped_cap*2 : 64;
+			im->stopped = realloc(im->stopped, sizeof(keyed *)*im->stopped_cap);
+		}
+		im->stopped[im->nstopped++] = i;
+	}
 }
 
-void quadratic_advance(keyed *i, struct key_frame *k, double dt) {
-	double v = 2*(k->setpoint-i->last_setpoint)/k->duration;
-	double a = v/k->duration;
-	double d = i->last_setpoint+v*k->elapsed-0.5*a*k->elapsed*k->elapsed;
-	i->changed = true;
-	i->current = d;
+static struct key_frame *key_alloc(struct interpolate_man *im) {
+	if (!im)
+		return tmalloc(struct key_frame, 1);
+	if (!im->free_keys) {
+		auto s = tmalloc(struct key_slab, 1);
+		s->next = im->slabs;
+		im->slabs = s;
+		for (int i = KEYS_PER_SLAB-1; i >= 0; i--) {
+			s->key[i].next = im->free_keys;
+			im->free_keys = &s->key[i];
+		}
+		im->stats.slabs++;
+	}
+	auto k = im->free_keys;
+	im->free_keys = k->next;
+	*k = (struct key_frame){0};
+	im->stats.keys_allocated++;
+	if (++im->stats.keys_live > im->stats.keys_peak)
+		im->stats.keys_peak = im->stats.keys_live;
+	return k;
 }
 
-// XXX this won't work with current model
-void step_advance(keyed *i, struct key_frame *k, double dt) {
-	int pos = (k->setpoint-i->last_setpoint)/k->duration*k->elapsed;
-	double old = i->current;
-	i->current = pos;
-	i->changed = fabs(old-i->current) > 1e-6;
+static void key_free(struct interpolate_man *im, struct key_frame *k) {
+	if (!im) {
+		free(k);
+		return;
+	}
+	k->next = im->free_keys;
+	im->free_keys = k;
+	im->stats.keys_live--;
 }
 
 void keyed_append_keyframe(keyed *i, struct key_frame *k) {
 	*i->last_key = k;
 	i->last_key = &k->next;
+	if (i->keys == k && i->im && !i->expiring) {
+		keyed_activate(i, i->im->now);
+		if (i->im->wake)
+			i->im->wake(i->im->wake_ud);
+	}
 }
 
 void keyed_truncate(keyed *i) {
+	if (i->batch)
+		keyed_deactivate(i);
 	auto k = i->keys;
 	while(k) {
 		auto next = k->next;
-		free(k);
+		key_free(i->im, k);
 		k = next;
 	}
+	i->keys = NULL;
+	i->last_key = &i->keys;
 	i->last_setpoint = i->current;
 }
 
-static void keyed_var_advance(var *_i, double dt) {
-	keyed *i = (void *)_i;
-	struct key_frame *new_head = i->keys;
-	if (!new_head) {
-		i->changed = false;
+// i went past the end of its first key frame. Drop the key frames it has
+// finished, calling their callbacks, and carry on with the next one, if
+// there is any. The next one starts exactly when the last one ended, not
+// at the time of this advance.
+static void keyed_expire(keyed *i) {
+	auto b = i->batch;
+	double now = i->im->now;
+	// A callback might have truncated i, or given it new keys already
+	if (!b || now-b->start[i->index] < b->duration[i->index])
 		return;
+
+	double end = b->start[i->index]+b->duration[i->index];
+	keyed_deactivate(i);
+	i->expiring = true;
+	while (i->keys) {
+		// Unlinked before the callback, which is free to truncate i
+		// and give it new key frames
+		auto k = i->keys;
+		i->keys = k->next;
+		if (!i->keys)
+			i->last_key = &i->keys;
+		k->elapsed = k->duration;
+		i->last_setpoint = i->current = k->setpoint;
+		if (k->callback)
+			k->callback(i, k, true, k->ud);
+		key_free(i->im, k);
+		if (!i->keys || now-end < i->keys->duration)
+			break;
+		end += i->keys->duration;
 	}
+	i->expiring = false;
+	// Nothing activates i while expiring is set, so the next key frame,
+	// old or added by a callback, starts when the last one ended
+	if (i->keys && !i->batch)
+		keyed_activate(i, end);
+}
 
-	// Remove expired frames, set changed to true, update last_setpoint,
-	// reset elapsed
-	double changed = false;
-	while(new_head && dt >= (new_head->duration-new_head->elapsed)) {
-		if (new_head->callback)
-			new_head->callback(i, new_head, true, new_head->ud);
-		dt -= new_head->duration-new_head->elapsed;
-		i->last_setpoint = new_head->setpoint;
-		i->current = new_head->setpoint;
-		changed = true;
+static bool keyed_var_changed(var *_i) {
+	keyed *i = (void *)_i;
+	// Vars without an interpolate_man are never advanced
+	return i->batch || !i->im || i->changed_tick == i->im->tick;
+}
 
-		struct key_frame *next = new_head->next;
-		free(new_head);
-		new_head = next;
-	}
+static double keyed_var_current(var *_i) {
+	keyed *i = (void *)_i;
+	return i->batch ? i->batch->current[i->index] : i->current;
+}
 
-	// Call advance on current key frame
-	if (new_head) {
-		new_head->elapsed += dt;
-		if (new_head->advance)
-			new_head->advance(i, new_head, dt);
-	} else
-		i->last_key = &i->keys;
+// 0 is what new vars have, so they always start out of date
+uint32_t var_epoch = 1;
 
-	i->changed = i->changed || changed;
-	i->keys = new_head;
+void var_new_epoch(void) {
+	if (!++var_epoch)
+		var_epoch = 1;
 }
 
-void interpolate_man_advance(struct interpolate_man *im, double dt) {
+// Until something is tracked, advancing doesn't have to look for flags
+static int ntracked;
+
+// Runs when the arena the flags live in goes away
+static void var_free_dependents(void *_v) {
+	var *v = _v;
+	if (v->ndependents)
+		ntracked--;
+	free(v->dependents);
+	v->dependents = NULL;
+	v->ndependents = v->dependents_cap = 0;
+}
+
+void var_add_dependent(var *v, bool *flag) {
+	if (!v->dependents_cap)
+		arena_defer_current(var_free_dependents, v);
+	if (!v->ndependents)
+		ntracked++;
+	if (v->ndependents == v->dependents_cap) {
+		v->dependents_cap = v->dependents_cap ? v->dependents_cap*2 : 4;
+		v->dependents = realloc(v->dependents, sizeof(bool *)*v->dependents_cap);
+	}
+	v->dependents[v->ndependents++] = flag;
+}
+
+static inline void var_mark_dependents(var *v) {
+	for (int i = 0; i < v->ndependents; i++)
+		*v->dependents[i] = true;
+}
+
+void interpolate_man_advance_to(struct interpolate_man *im, double now) {
+	uint64_t t = trace_begin();
+	double dt = now-im->now;
+	// Callbacks of finished key frames have run, can't go back on them
+	if (dt < 0)
+		dt = 0;
+	im->now += dt;
+	im->tick++;
+	im->nexpired = 0;
+	im->nstopped = 0;
+	for (int c = 0; c < NCURVES; c++) {
+		auto b = &im->batch[c];
+		im->advance_batch(b, im->now);
+		for (int j = 0; j < b->n; j++) {
+			if (im->now-b->start[j] < b->duration[j])
+				continue;
+			if (im->nexpired == im->expired_cap) {
+				im->expired_cap = im->expired_cap ? im->expired_cap*2 : 64;
+				im->expired = realloc(im->expired, sizeof(keyed *)*im->expired_cap);
+			}
+			im->expired[im->nexpired++] = b->owner[j];
+		}
+	}
+	// Vars can change batch here, that's why it's not done above
+	for (int j = 0; j < im->nexpired; j++)
+		keyed_expire(im->expired[j]);
+
+	// Everything that is moving or just stopped changed
+	for (int c = 0; ntracked && c < NCURVES; c++) {
+		auto b = &im->batch[c];
+		for (int j = 0; j < b->n; j++)
+			var_mark_dependents(&b->owner[j]->base);
+	}
+	for (int j = 0; j < im->nstopped; j++)
+		var_mark_dependents(&im->stopped[j]->base);
+
 	var *i;
-	list_for_each_entry(i, &im->interpolatables, siblings)
+	list_for_each_entry(i, &im->interpolatables, siblings) {
 		if (i->ops->advance)
 			i->ops->advance(i, dt);
+		if (i->ops->changed && i->ops->changed(i))
+			var_mark_dependents(i);
+	}
+	// After, in case a key callback looked at a var half way through
+	var_new_epoch();
+	trace_end("interpolate_man_advance", t);
+}
+
+void interpolate_man_advance(struct interpolate_man *im, double dt) {
+	interpolate_man_advance_to(im, im->now+dt);
+}
+
+double interpolate_man_now(const struct interpolate_man *im) {
+	return im->now;
+}
+
+bool interpolate_man_active(const struct interpolate_man *im) {
+	for (int c = 0; c < NCURVES; c++)
+		if (im->batch[c].n)
+			return true;
+	// Can't tell if these are going anywhere
+	return !list_empty(&im->interpolatables);
+}
+
+void interpolate_man_set_wake(struct interpolate_man *im, void (*wake)(void *ud), void *ud) {
+	im->wake = wake;
+	im->wake_ud = ud;
 }
 
 void interpolate_man_register(struct interpolate_man *im, var *i) {
 	list_add(&i->siblings, &im->interpolatables);
 }
 
+void interpolate_man_get_stats(const struct interpolate_man *im,
+                               struct interpolate_stats *s) {
+	*s = im->stats;
+}
+
+void interpolate_man_dump_stats(const struct interpolate_man *im, FILE *f) {
+	auto s = &im->stats;
+	fprintf(f, "key frames: %lu allocated, %lu live, %lu peak, %lu slabs (%zu KiB)\n",
+	        s->keys_allocated, s->keys_live, s->keys_peak, s->slabs,
+	        s->slabs*sizeof(struct key_slab)>>10);
+}
+
+void interpolate_man_free(struct interpolate_man *im) {
+	for (int c = 0; c < NCURVES; c++) {
+		auto b = &im->batch[c];
+		free(b->current);
+		free(b->last_setpoint);
+		free(b->setpoint);
+		free(b->start);
+		free(b->duration);
+		free(b->owner);
+	}
+	// Key frames all live in the slabs
+	while (im->slabs) {
+		auto next = im->slabs->next;
+		free(im->slabs);
+		im->slabs = next;
+	}
+	free(im->expired);
+	free(im->stopped);
+	free(im);
+}
+
+static void interpolate_man_free_deferred(void *im) {
+	interpolate_man_free(im);
+}
+
 struct interpolate_man *interpolate_man_new(void) {
 	auto im = tmalloc(struct interpolate_man, 1);
+	// Its vars can only be in the current arena, so it goes with them
+	arena_defer_current(interpolate_man_free_deferred, im);
 	INIT_LIST_HEAD(&im->interpolatables);
+	for (int c = 0; c < NCURVES; c++)
+		im->batch[c].curve = c;
+	im->advance_batch = batch_advance_scalar;
+#ifdef INTERPOLATE_X86
+	if (__builtin_cpu_supports("sse2"))
+		im->advance_batch = batch_advance_sse2;
+#endif
 	return im;
 }
 
 static struct key_frame *
-new_key(keyed *v, double set, double duration, key_cb cb, void *ud, size_t size) {
-	struct key_frame *k = calloc(1, size);
+new_key(keyed *v, double set, double duration, key_cb cb, void *ud, enum curve curve) {
+	auto k = key_alloc(v->im);
 	k->duration = duration;
 	k->elapsed = 0;
 	k->setpoint = set;
 	k->callback = cb;
+	k->curve = curve;
 	k->ud = ud;
 	keyed_append_keyframe(v, k);
 	return k;
@@ -136,24 +479,21 @@ new_key(keyed *v, double set, double duration, key_cb cb, void *ud, size_t size)
 
 void keyed_new_linear_key(keyed *v, double setpoint, double duration,
                           key_cb cb, void *ud) {
-	auto k = new_key(v, setpoint, duration, cb, ud, sizeof(struct key_frame));
-	k->advance = linear_advance;
+	new_key(v, setpoint, duration, cb, ud, CURVE_LINEAR);
 }
 
 void keyed_new_quadratic_key(keyed *v, double setpoint, double duration,
                              key_cb cb, void *ud) {
-	auto k = new_key(v, setpoint, duration, cb, ud, sizeof(struct key_frame));
-	k->advance = quadratic_advance;
+	new_key(v, setpoint, duration, cb, ud, CURVE_QUADRATIC);
 }
 
 var *new_keyed(struct interpolate_man *im, double val) {
-	keyed *ret = tmalloc(struct keyed_var, 1);
+	keyed *ret = amalloc(struct keyed_var, 1);
 	ret->base.ops = &keyed_var_ops;
-	ret->changed = true;
+	ret->im = im;
+	ret->changed_tick = im ? im->tick : 0;
 	ret->current = ret->last_setpoint = val;
 	ret->last_key = &ret->keys;
-	if (im)
-		interpolate_man_register(im, &ret->base);
 	return &ret->base;
 }
 
@@ -163,7 +503,7 @@ struct const_var {
 };
 
 var *new_const(double val) {
-	auto ret = tmalloc(struct const_var, 1);
+	auto ret = amalloc(struct const_var, 1);
 	ret->base.ops = &const_var_ops;
 	ret->current = val;
 	return &ret->base;
@@ -176,7 +516,7 @@ struct arith_var {
 };
 
 var *new_arith(enum op op, var *a, var *b) {
-	auto ret = tmalloc(struct arith_var, 1);
+	auto ret = amalloc(struct arith_var, 1);
 	ret->base.ops = &arith_var_ops;
 	ret->a = a;
 	ret->b = b;
@@ -184,6 +524,20 @@ var *new_arith(enum op op, var *a, var *b) {
 	return &ret->base;
 }
 
+void var_inspect(var *v, struct var_info *info) {
+	*info = (struct var_info){ .kind = VAR_OPAQUE };
+	if (v->ops == &const_var_ops) {
+		info->kind = VAR_CONST;
+		info->value = ((struct const_var *)v)->current;
+	} else if (v->ops == &arith_var_ops) {
+		struct arith_var *a = (void *)v;
+		info->kind = VAR_ARITH;
+		info->op = a->op;
+		info->a = a->a;
+		info->b = a->op == NEG ? NULL : a->b;
+	}
+}
+
 struct filter_var {
 	var base;
 	var *a;
@@ -194,17 +548,10 @@ static double const_var_current(var *i) {
 	return ((struct const_var *)i)->current;
 }
 
-static bool keyed_var_changed(var *i) {
-	return ((struct keyed_var *)i)->changed;
-}
-
-static double keyed_var_current(var *i) {
-	return ((struct keyed_var *)i)->current;
-}
-
 static bool arith_var_changed(var *i) {
 	struct arith_var *v = (void *)i;
-	return C(v->a) || C(v->b);
+	// NEG has no b
+	return C(v->a) || (v->b && C(v->b));
 }
 
 static double filter_var_current(var *i) {
@@ -231,7 +578,6 @@ static double arith_var_current(var *i) {
 
 const struct var_ops keyed_var_ops = {
 	.changed = keyed_var_changed,
-	.advance = keyed_var_advance,
 	.current = keyed_var_current,
 };
 
@@ -1,9 +1,11 @@
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include "list.h"
 
 struct var;
-struct key_frame *k;
+struct key_frame;
 struct var_ops {
 	double (*current)(struct var *i);
 	bool (*changed)(struct var *i);
@@ -13,6 +15,18 @@ struct var_ops {
 struct var {
 	struct list_head siblings;
 	const struct var_ops *ops;
+
+	// current() and changed() of the last epoch they were asked for,
+	// see var_epoch
+	uint32_t value_epoch, changed_epoch;
+	double value;
+	bool chg;
+
+	// Flags set when the var changes, see var_add_dependent()
+	bool **dependents;
+	int ndependents, dependents_cap;
+	// Scratch for walks over var graphs
+	uint32_t mark;
 };
 
 enum op {
@@ -29,14 +43,61 @@ typedef struct keyed_var keyed;
 struct interpolate_man;
 typedef void (*key_cb)(keyed *v, struct key_frame *k, bool finished, void *ud);
 
-void interpolate_man_advance(struct interpolate_man *, double);
+// Key frames are allocated from slabs owned by the interpolate_man, and
+// reused once they finish, so looping animations don't malloc
+struct interpolate_stats {
+	uint64_t keys_allocated; // ever
+	uint64_t keys_live, keys_peak;
+	uint64_t slabs;
+};
+
+// Move every var to where it is at time now, in seconds since the
+// interpolate_man was created. Time doesn't go backwards, an earlier
+// time is taken as no time passing.
+void interpolate_man_advance_to(struct interpolate_man *, double now);
+// Same as interpolate_man_advance_to(interpolate_man_now()+dt)
+void interpolate_man_advance(struct interpolate_man *, double dt);
+double interpolate_man_now(const struct interpolate_man *);
+// Whether any var is still moving
+bool interpolate_man_active(const struct interpolate_man *);
+// wake is called when a var that wasn't moving gets a key frame
+void interpolate_man_set_wake(struct interpolate_man *, void (*wake)(void *ud), void *ud);
+// When there is a current arena (see arena.h), the interpolate_man is
+// freed with it
 struct interpolate_man *interpolate_man_new(void);
+// Frees all its key frames too, its keyed vars can't be used after this
+void interpolate_man_free(struct interpolate_man *);
 void interpolate_man_register(struct interpolate_man *, var *);
+void interpolate_man_get_stats(const struct interpolate_man *, struct interpolate_stats *);
+void interpolate_man_dump_stats(const struct interpolate_man *, FILE *);
 var *new_keyed(struct interpolate_man *im, double val);
 var *new_const(double val);
 var *new_arith(enum op op, var *lhs, var *rhs);
 void keyed_new_linear_key(keyed *v, double set, double etc, key_cb cb, void *ud);
 void keyed_new_quadratic_key(keyed *v, double set, double etc, key_cb cb, void *ud);
+// Drop all key frames, v stays where it is
+void keyed_truncate(keyed *v);
+
+// What a var is made of, so var graphs can be compiled (see tape.h).
+// Only const and arith vars can be looked into, anything else is
+// VAR_OPAQUE and has to be evaluated through its ops.
+enum var_kind {
+	VAR_OPAQUE,
+	VAR_CONST,
+	VAR_ARITH,
+};
+struct var_info {
+	enum var_kind kind;
+	double value;  // VAR_CONST
+	enum op op;    // VAR_ARITH, b is NULL for NEG
+	var *a, *b;
+};
+void var_inspect(var *, struct var_info *);
+
+// *flag is set to true by interpolate_man_advance() whenever v changes.
+// Only vars that change on their own set their flags, so v should be
+// one var_inspect() can't look into.
+void var_add_dependent(var *v, bool *flag);
 
 #define vADD(a, b) new_arith(ADD, a, b)
 #define vNEG(a) new_arith(NEG, a, NULL)
@@ -46,7 +107,33 @@ extern const struct var_ops keyed_var_ops;
 extern const struct var_ops const_var_ops;
 extern const struct var_ops arith_var_ops;
 
-#define V(x) ((x)->ops->current(x))
-#define C(x) ((x)->ops->changed ? (x)->ops->changed(x) : false)
+// Var values only change when the epoch moves on, which happens on every
+// interpolate_man_advance() and var_new_epoch(). Until then V() and C()
+// return what they returned the first time, so a var shared by many
+// objects, or used many times in a frame, is only computed once.
+extern uint32_t var_epoch;
+// For code that changes var values outside of interpolate_man_advance()
+void var_new_epoch(void);
+
+static inline double var_current(var *v) {
+	if (v->value_epoch != var_epoch) {
+		v->value = v->ops->current(v);
+		v->value_epoch = var_epoch;
+	}
+	return v->value;
+}
+
+static inline bool var_changed(var *v) {
+	if (!v->ops->changed)
+		return false;
+	if (v->changed_epoch != var_epoch) {
+		v->chg = v->ops->changed(v);
+		v->changed_epoch = var_epoch;
+	}
+	return v->chg;
+}
+
+#define V(x) var_current(x)
+#define C(x) var_changed(x)
 #define VK(x) (keyed_var_ops.current(x))
 #define CK(x) (keyed_var_ops.changed(x))
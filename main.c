@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ev.h>
 #include <unistd.h>
+#include <signal.h>
 #include <ini.h>
 #include <libudev.h>
 #include "font.h"
@@ -11,8 +13,18 @@
 #include "backend.h"
 #include "render.h"
 #include "image.h"
+#include "blend.h"
+#include "fbpool.h"
+#include "resample.h"
+#include "stats.h"
+#include "trace.h"
+#include "replay.h"
+#include "synth.h"
+#include "tape.h"
+#include "arena.h"
 #include "input.h"
 #include "interpolate.h"
+#include "frame_sched.h"
 
 struct config {
 	struct backend *b;
@@ -22,54 +34,282 @@ struct config {
 	struct input *i;
 	struct font *f;
 	struct fb *cursor;
+	// Render target, kept across frames so only damage is repainted
+	struct fb *canvas;
+	int threads;
+	const char *trace;
+	// Requested output size, only honoured by the headless backend
+	uint32_t width, height;
+	// Where the pointer is, as the scene sees it
+	uint32_t pointer_x, pointer_y;
 
-	double last_timestamp;
+	// Input and frame times are logged to record, or, when replaying,
+	// come from replay instead of libinput and the clock
+	const char *record_path, *replay_path;
+	FILE *record;
+	struct replay *replay;
+
+	// Use a generated scene, see synth.h
+	bool synth;
+	struct synth_params synth_params;
+
+	// Frame times are relative to start, on CLOCK_MONOTONIC like the
+	// flip times
+	double start;
+	// When frames start, and the timer that starts them
+	struct sched sched;
+	ev_timer frame_timer;
+
+	// Nothing changed, so frames stopped being queued. request_frame()
+	// starts them again.
+	bool idle;
+	// Something changed that vars and objects don't know about
+	bool dirty;
+	ev_idle wake;
 };
 
 int coral_ini_handler(void *ud, const char *section, const char *name, const char *value) {
 	struct config *c = ud;
-	if (strcmp(name, "cursor") == 0) {
+	if (strcmp(section, "synth") == 0) {
+		if (!synth_params_set(&c->synth_params, name, value))
+			fprintf(stderr, "Unknown synthetic scene parameter %s\n", name);
+	} else if (strcmp(name, "cursor") == 0) {
 		c->cursor = load_image(value);
+	} else if (strcmp(name, "threads") == 0) {
+		c->threads = atoi(value);
+	} else if (strcmp(name, "hugepages") == 0) {
+		fb_pool_use_hugepages(strcmp(value, "true") == 0);
+	} else if (strcmp(name, "backend") == 0) {
+		if (strcmp(value, "headless") == 0)
+			c->bops = &headless_ops;
+		else if (strcmp(value, "drm") == 0)
+			c->bops = &drm_ops;
+		else
+			fprintf(stderr, "Unknown backend %s\n", value);
+	} else if (strcmp(name, "buffers") == 0) {
+		drm_set_buffers(atoi(value));
+	} else if (strcmp(name, "schedule") == 0) {
+		c->sched.asap = strcmp(value, "asap") == 0;
+	} else if (strcmp(name, "frame_margin") == 0) {
+		c->sched.margin = atof(value)/1e3;
+	} else if (strcmp(name, "refresh_rate") == 0) {
+		headless_set_refresh_rate(atof(value));
+	} else if (strcmp(name, "dump_dir") == 0) {
+		headless_set_dump_dir(value);
+	} else if (strcmp(name, "trace") == 0) {
+		c->trace = strdup(value);
+	} else if (strcmp(name, "scene") == 0) {
+		c->synth = strcmp(value, "synth") == 0;
+	} else if (strcmp(name, "record") == 0) {
+		c->record_path = strdup(value);
+	} else if (strcmp(name, "replay") == 0) {
+		c->replay_path = strdup(value);
+	} else if (strcmp(name, "width") == 0) {
+		c->width = atoi(value);
+	} else if (strcmp(name, "height") == 0) {
+		c->height = atoi(value);
 	}
 	return 1;
 }
 
 void load_config(struct config *cfg) {
-	const char *global_config = "/etc/coral.conf";
+	const char *global_config = getenv("CORAL_CONFIG");
+	if (!global_config)
+		global_config = "/etc/coral.conf";
 	if (access(global_config, R_OK) != 0)
 		return;
 
 	ini_parse(global_config, coral_ini_handler, (void *)cfg);
 }
 
+// Make sure a frame is rendered soon, waking the render loop if it's idle
+static void request_frame(void *ud) {
+	struct config *c = ud;
+	c->dirty = true;
+	if (c->idle) {
+		c->idle = false;
+		ev_idle_start(EV_DEFAULT, &c->wake);
+	}
+}
+
+void mouse_button_cb(int button, uint16_t state, bool pressed, void *ud) {
+	struct config *c = ud;
+	if (!c->replay)
+		stats_input(stats_now());
+	if (c->record)
+		record_event(c->record, &(struct replay_event){
+		    .kind = REPLAY_BUTTON, .t = stats_now()-c->start,
+		    .button = button, .state = state, .pressed = pressed });
+	if (pressed)
+		handle_mouse_button(c->s, c->pointer_x, c->pointer_y, state, button);
+	request_frame(c);
+}
+
+void mouse_move_cb(uint32_t x, uint32_t y, void *ud) {
+	struct config *c = ud;
+	if (!c->replay)
+		stats_input(stats_now());
+	if (c->record)
+		record_event(c->record, &(struct replay_event){
+		    .kind = REPLAY_MOVE, .t = stats_now()-c->start, .x = x, .y = y });
+	c->pointer_x = x;
+	c->pointer_y = y;
+	handle_mouse_move(c->s, x, y);
+	// The cursor moved, if nothing else
+	request_frame(c);
+}
+
+// Feed the input logged before the next frame to the scene, and return
+// that frame's time in *t. False when the log has run out.
+static bool replay_frame(struct config *c, double *t) {
+	struct replay_event e;
+	while (replay_next(c->replay, &e)) {
+		switch (e.kind) {
+		case REPLAY_FRAME:
+			*t = e.t;
+			return true;
+		case REPLAY_MOVE:
+			mouse_move_cb(e.x, e.y, c);
+			break;
+		case REPLAY_BUTTON:
+			mouse_button_cb(e.button, e.state, e.pressed, c);
+			break;
+		}
+	}
+	return false;
+}
+
+static void start_frame_timer(EV_P_ struct config *c, double delay) {
+	trace_instant("schedule", "delay_us", delay*1e6);
+	ev_timer_set(&c->frame_timer, delay, 0);
+	ev_timer_start(EV_A_ &c->frame_timer);
+}
+
 void render_callback(EV_P_ void *user_data) {
 	struct config *c = user_data;
-	struct fb *fb = c->bops->new_fb(c->b, RENDER_FB);
-	if (!fb)
-		ev_break(EV_A_ EVBREAK_ALL);
-	interpolate_man_advance(c->im, ev_now(EV_A)-c->last_timestamp);
-	c->last_timestamp = ev_now(EV_A);
-	render_scene(fb, c->s);
+	struct fb *fb = c->canvas;
+	// The last frame already shows everything, stop until something
+	// changes. Replays render every frame they logged.
+	if (!c->replay && !c->dirty && !scene_pending(c->s) && !interpolate_man_active(c->im)) {
+		// A flip can still come in after a frame rendered ahead
+		if (!c->idle) {
+			c->idle = true;
+			stats_idle();
+			trace_instant("idle", NULL, 0);
+		}
+		return;
+	}
+	c->dirty = false;
+
+	uint64_t tr = trace_begin();
+	double now;
+	if (c->replay) {
+		if (!replay_frame(c, &now)) {
+			ev_break(EV_A_ EVBREAK_ALL);
+			return;
+		}
+	} else
+		now = sched_present(&c->sched, c->b)-c->start;
+	if (c->record)
+		record_event(c->record, &(struct replay_event){ .kind = REPLAY_FRAME, .t = now });
+
+	double t0 = stats_now();
+	stats_frame_start(t0);
+	interpolate_man_advance_to(c->im, now);
+	double t1 = stats_now();
+	auto damage = render_scene(fb, c->s);
+	stats_record(PHASE_ADVANCE, t1-t0);
+	stats_record(PHASE_RENDER, stats_now()-t1);
 	//fprintf(stderr, "queue frame\n");
 
-	uint32_t x, y;
-	libinput_ops.pointer_coord(c->i, &x, &y);
-	c->bops->queue_frame(c->b, fb, x, y);
+	int ret = c->bops->queue_frame(c->b, fb, damage, c->pointer_x, c->pointer_y);
+	if (ret == -1)
+		stats_dropped();
+	sched_frame_cost(&c->sched, stats_now()-t0);
+
+	// Render ahead: while this frame waits for its flip, the next one
+	// can be rendered and wait behind it. The schedule still decides
+	// when it starts, so it is only queued that early when frames take
+	// too long to start them just in time.
+	auto b = c->b;
+	if (ret == 0 && b->in_flight && !b->queued && !b->busy &&
+	    !ev_is_active(&c->frame_timer)) {
+		double delay = c->replay ? 0 : sched_delay(&c->sched, b);
+		start_frame_timer(EV_A_ c, delay > 0 ? delay : 0);
+	}
+	trace_end("render_callback", tr);
+}
+
+static void frame_timer_cb(EV_P_ ev_timer *w, int revents) {
+	render_callback(EV_A_ w->data);
 }
 
-void mouse_button_cb(int button, uint16_t state, bool pressed, void *ud) {
+// Start the next frame when the schedule says, which is just in time for
+// the vblank it is for. Replays render every frame as soon as they can.
+static void schedule_frame(EV_P_ void *user_data) {
+	struct config *c = user_data;
+	if (ev_is_active(&c->frame_timer))
+		return;
+	double delay = c->replay ? 0 : sched_delay(&c->sched, c->b);
+	if (delay <= 0)
+		render_callback(EV_A_ c);
+	else
+		start_frame_timer(EV_A_ c, delay);
+}
 
+static void wake_cb(EV_P_ ev_idle *w, int revents) {
+	ev_idle_stop(EV_A_ w);
+	schedule_frame(EV_A_ w->data);
 }
 
-void mouse_move_cb(uint32_t x, uint32_t y, void *ud) {
-	struct config *c = ud;
-	handle_mouse_move(c->s, x, y);
+static void quit_cb(EV_P_ ev_signal *w, int revents) {
+	ev_break(EV_A_ EVBREAK_ALL);
+}
+
+static void dump_stats_cb(EV_P_ ev_signal *w, int revents) {
+	struct config *c = w->data;
+	stats_dump(stderr);
+	fb_pool_dump_stats(stderr);
+	resample_dump_stats(stderr);
+	interpolate_man_dump_stats(c->im, stderr);
+	sched_dump(&c->sched, stderr);
 }
 
 int main() {
 	struct config cfg = {0};
+	cfg.bops = &drm_ops;
+	synth_params_default(&cfg.synth_params);
+	sched_init(&cfg.sched);
 	load_config(&cfg);
-	cfg.im = interpolate_man_new();
+	// Handy for running without a config, e.g. when benchmarking
+	const char *backend = getenv("CORAL_BACKEND");
+	if (backend && strcmp(backend, "headless") == 0)
+		cfg.bops = &headless_ops;
+	if (getenv("CORAL_TRACE"))
+		cfg.trace = getenv("CORAL_TRACE");
+	if (cfg.trace)
+		trace_start(cfg.trace);
+	if (getenv("CORAL_REPLAY"))
+		cfg.replay_path = getenv("CORAL_REPLAY");
+	if (cfg.replay_path) {
+		cfg.replay = replay_open(cfg.replay_path);
+		if (!cfg.replay)
+			return -1;
+		// Replays are for measuring, they don't need a screen
+		cfg.bops = &headless_ops;
+	} else if (cfg.record_path) {
+		cfg.record = record_open(cfg.record_path);
+		if (!cfg.record)
+			return -1;
+	}
+	blend_init();
+	if (cfg.threads <= 0) {
+		// Compositing stops scaling well past 8 threads
+		cfg.threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (cfg.threads > 8)
+			cfg.threads = 8;
+	}
+	render_set_threads(cfg.threads);
 	cfg.f = init_font();
 	load_font(cfg.f, "Helvetica Neue Regular");
 	if (!cfg.f) {
@@ -86,16 +326,21 @@ int main() {
 	size_t nusers;
 	auto users = load_users(&nusers);
 
-	cfg.bops = &drm_ops;
-	// w, h is ignored right now. Do we really need that?
-	cfg.b = cfg.bops->setup(EV_DEFAULT, u, 0, 0);
+	// drm ignores w, h right now. Do we really need that?
+	cfg.b = cfg.bops->setup(EV_DEFAULT, u, cfg.width, cfg.height);
 	if (!cfg.b)
 		return -1;
 
-	cfg.i = libinput_ops.setup(EV_DEFAULT, u, cfg.b->w, cfg.b->h);
-	cfg.i->user_data = &cfg;
-	cfg.i->mouse_button_cb = mouse_button_cb;
-	cfg.i->mouse_move_cb = mouse_move_cb;
+	if (!cfg.replay)
+		cfg.i = libinput_ops.setup(EV_DEFAULT, u, cfg.b->w, cfg.b->h);
+	if (cfg.i) {
+		cfg.i->user_data = &cfg;
+		cfg.i->mouse_button_cb = mouse_button_cb;
+		cfg.i->mouse_move_cb = mouse_move_cb;
+	} else if (cfg.bops != &headless_ops) {
+		fprintf(stderr, "Could not initialize input\n");
+		return -1;
+	}
 
 	if (!cfg.cursor) {
 		cfg.cursor = new_fb(32, 32, ARGB8888);
@@ -103,24 +348,67 @@ int main() {
 	}
 	cfg.bops->set_cursor(cfg.b, cfg.cursor);
 
-	cfg.s = build_scene(cfg.im, users, nusers, cfg.b->w, cfg.b->h);
+	// The scene, its vars and its interpolate_man all go in one arena
+	auto prev = arena_set_current(arena_new());
+	cfg.im = interpolate_man_new();
+	if (cfg.synth)
+		cfg.s = build_synth_scene(cfg.im, &cfg.synth_params, cfg.b->w, cfg.b->h);
+	else
+		cfg.s = build_scene(cfg.im, users, nusers, cfg.b->w, cfg.b->h);
+	arena_set_current(prev);
 	if (!cfg.s)
 		return 1;
+
+	scene_track_deps(cfg.s);
+	struct tape_stats ts;
+	tape_get_stats(tape_compile(cfg.s), &ts);
+	fprintf(stderr, "Tape: %d var nodes in %d slots, %d consts, %d inputs, %d ops\n",
+	        ts.nodes, ts.slots, ts.consts, ts.inputs, ts.ops);
 	cfg.b->user_data = &cfg;
-	cfg.b->page_flip_cb = render_callback;
-	cfg.last_timestamp = ev_now(EV_DEFAULT);
+	cfg.b->page_flip_cb = schedule_frame;
+	ev_idle_init(&cfg.wake, wake_cb);
+	cfg.wake.data = &cfg;
+	ev_init(&cfg.frame_timer, frame_timer_cb);
+	cfg.frame_timer.data = &cfg;
+	interpolate_man_set_wake(cfg.im, request_frame, &cfg);
+	scene_set_wake(cfg.s, request_frame, &cfg);
 
 	// Render first frame
-	struct fb *fb = cfg.bops->new_fb(cfg.b, RENDER_FB);
-	if (!fb)
+	cfg.canvas = cfg.bops->new_fb(cfg.b, RENDER_FB);
+	if (!cfg.canvas)
 		return 1;
-	cfg.last_timestamp = ev_now(EV_DEFAULT);
-	render_scene(fb, cfg.s);
+	struct fb *fb = cfg.canvas;
+	cfg.start = stats_now();
+	auto damage = render_scene(fb, cfg.s);
+	cfg.bops->queue_frame(cfg.b, fb, damage, cfg.pointer_x, cfg.pointer_y);
 
-	uint32_t x, y;
-	libinput_ops.pointer_coord(cfg.i, &x, &y);
-	cfg.bops->queue_frame(cfg.b, fb, x, y);
+	// kill -USR1 to see how frames are doing
+	ev_signal sigusr1;
+	ev_signal_init(&sigusr1, dump_stats_cb, SIGUSR1);
+	sigusr1.data = &cfg;
+	ev_signal_start(EV_DEFAULT, &sigusr1);
+	// Leave through the cleanup below, so the record log and trace are
+	// complete
+	ev_signal sigint, sigterm;
+	ev_signal_init(&sigint, quit_cb, SIGINT);
+	ev_signal_start(EV_DEFAULT, &sigint);
+	ev_signal_init(&sigterm, quit_cb, SIGTERM);
+	ev_signal_start(EV_DEFAULT, &sigterm);
 	ev_run(EV_DEFAULT, 0);
 
+	trace_stop();
+	if (cfg.record)
+		fclose(cfg.record);
+	if (cfg.replay) {
+		fprintf(stderr, "Replayed %zu frames from %s\n",
+		        replay_nframes(cfg.replay), cfg.replay_path);
+		replay_close(cfg.replay);
+	}
+	stats_dump(stderr);
+	fb_pool_dump_stats(stderr);
+	resample_dump_stats(stderr);
+	interpolate_man_dump_stats(cfg.im, stderr);
+	sched_dump(&cfg.sched, stderr);
+	scene_free(cfg.s);
 	return 0;
 }
@@ -4,14 +4,31 @@
 #include "interpolate.h"
 #include "render.h"
 #include "list.h"
+#include "region.h"
 
 struct object {
 	void *user_data;
 	struct list_head siblings;
 	void (*render)(struct object *);
+	// Paint the object straight into the target, limited to clip.
+	// Objects that have this don't get a fb, render() then only
+	// prepares what draw() needs. Called from worker threads, so it
+	// must not evaluate any var.
+	void (*draw)(struct object *, struct fb *target, const struct box *clip);
+	// Let go of what the object holds besides fb, optional
+	void (*destroy)(struct object *);
 	var *x, *y, *w, *h;
 	struct fb fb;
 	bool need_render;
+	// The vars of a tracked object set dirty when they change, so an
+	// untouched object is skipped by render_scene() without looking at
+	// its vars. See scene_track_deps().
+	bool tracked, dirty;
+
+	// Where fb was composited in the last frame
+	struct box drawn;
+	// Nothing below the object shows through anywhere in drawn
+	bool opaque;
 
 	int nparams;
 	var *param[0];
@@ -19,6 +36,25 @@ struct object {
 
 struct scene {
 	struct object *focus;
+
+	// Damage of the last render_scene(), and the fb it was rendered to
+	struct region damage;
+	const uint8_t *target;
+	int32_t target_w, target_h;
+
+	// Where everything in the scene was allocated, NULL if it wasn't
+	// made in an arena, see scene_free()
+	struct arena *arena;
+	// Compiled vars of the objects, see tape.h
+	struct tape *tape;
+
+	// Some object asked to be rendered again by the last render_scene(),
+	// or the scene was invalidated since
+	bool pending;
+	// Called by scene_invalidate()
+	void (*wake)(void *ud);
+	void *wake_ud;
+
 	int nlayers;
 	struct list_head layer[0];
 };
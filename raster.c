@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "common.h"
+#include "render.h"
+#include "blend.h"
+#include "raster.h"
+
+// Extra room given to the anti-aliased edge when working out which
+// pixels are fully in or out. The edge estimate for ellipses isn't
+// exact, so don't trust it to the last pixel.
+#define MARGIN 1.0
+
+// Half width of the level set sdist == e of s, on the row dy away from
+// the center. Negative if the row doesn't cross it.
+static double extent(const struct shape *s, double dy, double e) {
+	dy = fabs(dy);
+	double hw = s->hw+e, hh = s->hh+e;
+	if (hw <= 0 || hh <= 0 || dy >= hh)
+		return -1;
+
+	switch (s->kind) {
+	case SHAPE_ELLIPSE:
+		return hw*sqrt(1-dy*dy/(hh*hh));
+	case SHAPE_ROUNDED_RECT: {
+		// Offsetting a rounded rect grows its corner radius too
+		double r = fmax(s->radius+e, 0);
+		double t = dy-(hh-r);
+		if (t <= 0)
+			return hw;
+		return hw-r+sqrt(r*r-t*t);
+	}
+	default: __builtin_unreachable();
+	}
+}
+
+// Signed distance to the edge of s, negative inside
+static double sdist(const struct shape *s, double dx, double dy) {
+	dx = fabs(dx);
+	dy = fabs(dy);
+	switch (s->kind) {
+	case SHAPE_ELLIPSE: {
+		if (s->hw == s->hh)
+			return hypot(dx, dy)-s->hw;
+		// First order estimate, f(p)/|grad f(p)|, fine near the edge
+		double nx = dx/s->hw, ny = dy/s->hh;
+		double f = hypot(nx, ny);
+		if (f == 0)
+			return -fmin(s->hw, s->hh);
+		double g = hypot(nx/s->hw, ny/s->hh)/f;
+		return (f-1)/g;
+	}
+	case SHAPE_ROUNDED_RECT: {
+		double r = s->radius;
+		double qx = dx-(s->hw-r), qy = dy-(s->hh-r);
+		return hypot(fmax(qx, 0), fmax(qy, 0))+fmin(fmax(qx, qy), 0)-r;
+	}
+	default: __builtin_unreachable();
+	}
+}
+
+static inline double cover(double sd) {
+	return sd <= -0.5 ? 1 : sd >= 0.5 ? 0 : 0.5-sd;
+}
+
+static struct span *push_span(struct coverage *c, int32_t x, int32_t y, int32_t len, int32_t mask) {
+	if (c->nspan == c->span_cap) {
+		c->span_cap = c->span_cap ? c->span_cap*2 : 64;
+		c->span = realloc(c->span, sizeof(struct span)*c->span_cap);
+	}
+	auto s = &c->span[c->nspan++];
+	*s = (struct span){ x, y, len, mask };
+	return s;
+}
+
+static void push_alpha(struct coverage *c, uint8_t a) {
+	if (c->nalpha == c->alpha_cap) {
+		c->alpha_cap = c->alpha_cap ? c->alpha_cap*2 : 256;
+		c->alpha = realloc(c->alpha, c->alpha_cap);
+	}
+	c->alpha[c->nalpha++] = a;
+}
+
+struct row {
+	struct coverage *c;
+	const struct shape *outer, *inner;
+	int32_t x, w;
+	double cx, dy;
+};
+
+// Columns [y1, y2] of the row, coverage worked out pixel by pixel
+static void edge_run(struct row *r, int32_t y1, int32_t y2) {
+	if (y1 < 0)
+		y1 = 0;
+	if (y2 >= r->w)
+		y2 = r->w-1;
+
+	int cur = -1;
+	for (int32_t y = y1; y <= y2; y++) {
+		double dx = y+0.5-r->cx;
+		double cv = cover(sdist(r->outer, dx, r->dy));
+		if (r->inner)
+			cv *= 1-cover(sdist(r->inner, dx, r->dy));
+		uint8_t a = cv*255+0.5;
+		if (!a) {
+			cur = -1;
+			continue;
+		}
+		if (cur < 0) {
+			push_span(r->c, r->x, y, 0, r->c->nalpha);
+			cur = r->c->nspan-1;
+		}
+		push_alpha(r->c, a);
+		r->c->span[cur].len++;
+	}
+}
+
+static void solid_run(struct row *r, int32_t y1, int32_t y2) {
+	if (y1 < 0)
+		y1 = 0;
+	if (y2 >= r->w)
+		y2 = r->w-1;
+	if (y1 <= y2)
+		push_span(r->c, r->x, y1, y2-y1+1, -1);
+}
+
+// One half of a row. Pixel k away from the center column is at
+// distance d0+k from the center, and is column col(k).
+static void
+half_row(struct row *r, double d0, int32_t cmid, int dir,
+         double oz, double of, double iz, double ifull) {
+#define COL(k) (dir > 0 ? cmid+(k) : cmid-1-(k))
+#define RUN(fn, k1, k2) do { \
+	if ((k1) <= (k2)) { \
+		if (dir > 0) fn(r, COL(k1), COL(k2)); \
+		else fn(r, COL(k2), COL(k1)); \
+	} \
+} while(0)
+	int32_t kmax = ceil(oz-d0)-1;
+	int32_t kstart = iz > 0 ? fmax(ceil(iz-d0), 0) : 0;
+	int32_t ks1 = fmax(ceil(ifull-d0), kstart);
+	int32_t ks2 = of > 0 ? fmin(floor(of-d0), kmax) : -1;
+
+	if (ks1 <= ks2) {
+		RUN(edge_run, kstart, ks1-1);
+		RUN(solid_run, ks1, ks2);
+		RUN(edge_run, ks2+1, kmax);
+	} else
+		RUN(edge_run, kstart, kmax);
+#undef RUN
+#undef COL
+}
+
+void raster_shape(struct coverage *c, int32_t w, int32_t h,
+                  const struct shape *outer, const struct shape *inner) {
+	coverage_clear(c);
+	struct row r = {
+		.c = c,
+		.outer = outer,
+		.inner = inner,
+		.w = w,
+		.cx = w/2.0,
+	};
+	int32_t cmid = ceil(r.cx-0.5);
+	double d0 = cmid+0.5-r.cx;
+	double cy = h/2.0;
+
+	for (r.x = 0; r.x < h; r.x++) {
+		r.dy = r.x+0.5-cy;
+		// Beyond oz nothing is covered, within of everything is, as
+		// far as outer is concerned. Within iz nothing is covered,
+		// beyond ifull everything is, as far as inner is concerned.
+		double oz = extent(outer, r.dy, 0.5+MARGIN);
+		if (oz < 0)
+			continue;
+		double of = extent(outer, r.dy, -0.5-MARGIN);
+		double iz = -1, ifull = 0;
+		if (inner) {
+			iz = extent(inner, r.dy, -0.5-MARGIN);
+			ifull = fmax(extent(inner, r.dy, 0.5+MARGIN), 0);
+		}
+		half_row(&r, 1-d0, cmid, -1, oz, of, iz, ifull);
+		half_row(&r, d0, cmid, 1, oz, of, iz, ifull);
+	}
+}
+
+void raster_paint(struct fb *fb, const struct coverage *c, uint32_t pixel) {
+	for (int i = 0; i < c->nspan; i++) {
+		auto s = &c->span[i];
+		uint32_t *dst = (uint32_t *)(fb->data+s->x*fb->pitch)+s->y;
+		if (s->mask < 0) {
+			blend->fill(dst, pixel, s->len);
+			continue;
+		}
+		auto a = c->alpha+s->mask;
+		for (int32_t j = 0; j < s->len; j++)
+			dst[j] = px_scale(pixel, a[j]);
+	}
+}
+
+void coverage_clear(struct coverage *c) {
+	c->nspan = 0;
+	c->nalpha = 0;
+}
+
+void coverage_fini(struct coverage *c) {
+	free(c->span);
+	free(c->alpha);
+	*c = (struct coverage){0};
+}
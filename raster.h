@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+struct fb;
+
+enum shape_kind {
+	SHAPE_ELLIPSE,
+	SHAPE_ROUNDED_RECT,
+};
+
+// A shape centered in a w x h area. hw, hh are the half width and half
+// height, radius is the corner radius of rounded rects.
+struct shape {
+	enum shape_kind kind;
+	double hw, hh;
+	double radius;
+};
+
+// A horizontal run of pixels on row x, columns [y, y+len). mask < 0
+// means the run is fully covered, otherwise the run's coverage is in
+// coverage.alpha[mask...mask+len).
+struct span {
+	int32_t x, y, len;
+	int32_t mask;
+};
+
+// Anti-aliased coverage of a shape, as spans. Building it is the
+// expensive part, painting it with a colour is cheap.
+struct coverage {
+	struct span *span;
+	int nspan, span_cap;
+	uint8_t *alpha;
+	int nalpha, alpha_cap;
+};
+
+void coverage_clear(struct coverage *);
+void coverage_fini(struct coverage *);
+
+// Coverage of outer minus inner, both centered in a w x h area. inner
+// can be NULL. Coverage is analytic: each pixel is covered by how far
+// its center is inside the shape's edge, clamped to one pixel.
+void raster_shape(struct coverage *, int32_t w, int32_t h,
+                  const struct shape *outer, const struct shape *inner);
+
+// Write the premultiplied colour pixel, scaled by coverage, into fb.
+// Pixels outside the coverage are left alone.
+void raster_paint(struct fb *, const struct coverage *, uint32_t pixel);
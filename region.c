@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common.h"
+#include "region.h"
+
+static inline struct box box_bound(const struct box *a, const struct box *b) {
+	return (struct box){
+		.x1 = a->x1 < b->x1 ? a->x1 : b->x1,
+		.y1 = a->y1 < b->y1 ? a->y1 : b->y1,
+		.x2 = a->x2 > b->x2 ? a->x2 : b->x2,
+		.y2 = a->y2 > b->y2 ? a->y2 : b->y2,
+	};
+}
+
+// How many pixels we would needlessly repaint if a and b were merged
+static inline int64_t merge_waste(const struct box *a, const struct box *b) {
+	auto u = box_bound(a, b);
+	struct box i;
+	int64_t overlap = box_intersect(a, b, &i) ? box_area(&i) : 0;
+	return box_area(&u)-box_area(a)-box_area(b)+overlap;
+}
+
+static inline void region_remove(struct region *r, int i) {
+	r->box[i] = r->box[--r->nbox];
+}
+
+void region_init(struct region *r) {
+	r->box = NULL;
+	r->nbox = r->cap = 0;
+}
+
+void region_fini(struct region *r) {
+	free(r->box);
+	region_init(r);
+}
+
+void region_clear(struct region *r) {
+	r->nbox = 0;
+}
+
+void region_add_box(struct region *r, const struct box *_b) {
+	if (box_empty(_b))
+		return;
+
+	auto b = *_b;
+	// Fold in everything b overlaps, or that is cheap to merge with.
+	// Merging can make b overlap boxes it didn't before, so start over
+	// every time b grows.
+	for (int i = 0; i < r->nbox; ) {
+		struct box tmp;
+		if (box_intersect(&b, &r->box[i], &tmp) ||
+		    merge_waste(&b, &r->box[i]) <= 0) {
+			b = box_bound(&b, &r->box[i]);
+			region_remove(r, i);
+			i = 0;
+		} else
+			i++;
+	}
+
+	if (r->nbox == REGION_MAX_BOXES) {
+		// Full, merge b into the box that wastes the least
+		int best = 0;
+		int64_t best_waste = INT64_MAX;
+		for (int i = 0; i < r->nbox; i++) {
+			auto w = merge_waste(&b, &r->box[i]);
+			if (w < best_waste) {
+				best = i;
+				best_waste = w;
+			}
+		}
+		b = box_bound(&b, &r->box[best]);
+		region_remove(r, best);
+		region_add_box(r, &b);
+		return;
+	}
+
+	if (r->nbox == r->cap) {
+		r->cap = r->cap ? r->cap*2 : 4;
+		r->box = realloc(r->box, sizeof(struct box)*r->cap);
+	}
+	r->box[r->nbox++] = b;
+}
+
+void region_union(struct region *r, const struct region *o) {
+	assert(r != o);
+	for (int i = 0; i < o->nbox; i++)
+		region_add_box(r, &o->box[i]);
+}
+
+void region_clip(struct region *r, const struct box *clip) {
+	for (int i = 0; i < r->nbox; ) {
+		if (!box_intersect(&r->box[i], clip, &r->box[i]))
+			region_remove(r, i);
+		else
+			i++;
+	}
+}
+
+int64_t region_area(const struct region *r) {
+	int64_t ret = 0;
+	for (int i = 0; i < r->nbox; i++)
+		ret += box_area(&r->box[i]);
+	return ret;
+}
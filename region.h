@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Same convention as the rest of coral: x is the row, y is the column.
+// A box covers rows [x1, x2) and columns [y1, y2).
+struct box {
+	int32_t x1, y1, x2, y2;
+};
+
+// A set of boxes. Boxes are merged as they are added, so a region never
+// holds more than REGION_MAX_BOXES of them; the price is that it might
+// cover a bit more than what was added.
+struct region {
+	struct box *box;
+	int nbox, cap;
+};
+
+#define REGION_MAX_BOXES 16
+
+static inline bool box_empty(const struct box *b) {
+	return b->x1 >= b->x2 || b->y1 >= b->y2;
+}
+
+static inline bool box_eq(const struct box *a, const struct box *b) {
+	return a->x1 == b->x1 && a->y1 == b->y1 && a->x2 == b->x2 && a->y2 == b->y2;
+}
+
+static inline int64_t box_area(const struct box *b) {
+	if (box_empty(b))
+		return 0;
+	return (int64_t)(b->x2-b->x1)*(b->y2-b->y1);
+}
+
+// Returns false if a and b don't intersect, out is undefined then
+static inline bool box_intersect(const struct box *a, const struct box *b, struct box *out) {
+	out->x1 = a->x1 > b->x1 ? a->x1 : b->x1;
+	out->y1 = a->y1 > b->y1 ? a->y1 : b->y1;
+	out->x2 = a->x2 < b->x2 ? a->x2 : b->x2;
+	out->y2 = a->y2 < b->y2 ? a->y2 : b->y2;
+	return !box_empty(out);
+}
+
+void region_init(struct region *);
+void region_fini(struct region *);
+void region_clear(struct region *);
+void region_add_box(struct region *, const struct box *);
+void region_union(struct region *, const struct region *);
+// Drop everything outside of clip
+void region_clip(struct region *, const struct box *clip);
+int64_t region_area(const struct region *);
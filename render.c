@@ -6,101 +6,67 @@
 #include <string.h>
 #include <stddef.h>
 #include <limits.h>
+#include <math.h>
 
-#define STB_IMAGE_RESIZE_IMPLEMENTATION
-#include <stb/stb_image_resize.h>
 #include "common.h"
 #include "list.h"
 #include "object.h"
-
-void blit(const struct fb *bottom, const struct fb *top,
-	  int32_t x, int32_t y) {
+#include "blend.h"
+#include "workers.h"
+#include "raster.h"
+#include "resample.h"
+#include "trace.h"
+#include "tape.h"
+#include "arena.h"
+
+void blit_clipped(const struct fb *bottom, const struct fb *top,
+		  int32_t x, int32_t y, const struct box *clip) {
 	assert(pixfmt_compat(bottom->pixfmt, top->pixfmt));
 	assert(top->height <= INT_MAX);
 	assert(top->data);
 
-	int32_t w = top->width, h = top->height;
-	//Clipping
-	if (x >= bottom->height || y >= bottom->width)
+	//Clipping, in bottom's coordinates
+	struct box dst = { x, y, x+top->height, y+top->width };
+	struct box screen = { 0, 0, bottom->height, bottom->width };
+	if (!box_intersect(&dst, &screen, &dst))
 		// outside
 		return;
-	if (x < -h || y < -w)
-		// outside
+	if (clip && !box_intersect(&dst, clip, &dst))
 		return;
 
-	int32_t src_x = 0, src_y = 0;
-	// clip top
-	if (x < 0)
-		src_x = -x;
-	// clip left
-	if (y < 0)
-		src_y = -y;
-	// clip bottom
-	if (x+h >= bottom->height)
-		h = bottom->height-x-1;
-	//clip right
-	if (y+w >= bottom->width)
-		w = bottom->width-y-1;
-
-	if (top->pixfmt == XRGB8888) {
-		uint32_t real_pitch = (w-src_y)*pixfmt_bpp(top->pixfmt);
-		for (uint32_t i = src_x; i < h; i++) {
-			auto basea = i*top->pitch+src_y*pixfmt_bpp(top->pixfmt);
-			auto baseb = (i+x)*bottom->pitch+(y+src_y)*pixfmt_bpp(bottom->pixfmt);
-			memcpy(bottom->data+baseb, top->data+basea, real_pitch);
-		}
-		return;
-	}
-
-	for (uint32_t i = src_x; i < h; i++) {
-		auto basea = i*top->pitch+src_y*pixfmt_bpp(top->pixfmt);
-		auto baseb = (i+x)*bottom->pitch+y*pixfmt_bpp(bottom->pixfmt);
-		for (uint32_t j = src_y; j < w; j++) {
-			if (!top->data[basea+3])
-				continue;
-
-			double ialpha = (255.0-top->data[basea+3])/255.0;
-			bottom->data[baseb] = bottom->data[baseb]*ialpha+top->data[basea];
-			bottom->data[baseb+1] = bottom->data[baseb+1]*ialpha+top->data[basea+1];
-			bottom->data[baseb+2] = bottom->data[baseb+2]*ialpha+top->data[basea+2];
-			basea += pixfmt_bpp(bottom->pixfmt);
-			baseb += pixfmt_bpp(top->pixfmt);
-		}
+	auto bpp = pixfmt_bpp(top->pixfmt);
+	int32_t w = dst.y2-dst.y1;
+	for (int32_t i = dst.x1; i < dst.x2; i++) {
+		auto src = top->data+(i-x)*top->pitch+(dst.y1-y)*bpp;
+		auto dstp = bottom->data+i*bottom->pitch+dst.y1*bpp;
+		if (top->pixfmt == XRGB8888)
+			memcpy(dstp, src, w*bpp);
+		else
+			blend->over((uint32_t *)dstp, (const uint32_t *)src, w);
 	}
 }
 
-static inline void
-pixel(struct fb *fb, uint32_t x, uint32_t y, struct color c) {
-	uint32_t off = x*fb->pitch+y*pixfmt_bpp(fb->pixfmt);
-	fb->data[off] = c.b*c.a/255.0;
-	fb->data[off+1] = c.g*c.a/255.0;
-	fb->data[off+2] = c.r*c.a/255.0;
-	fb->data[off+3] = c.a;
-}
-
-static inline void
-xline(struct fb *fb, uint32_t x1, uint32_t x2, uint32_t y,
-      struct color c) {
-	while (x1 <= x2) pixel(fb, x1++, y, c);
+void blit(const struct fb *bottom, const struct fb *top,
+	  int32_t x, int32_t y) {
+	blit_clipped(bottom, top, x, y, NULL);
 }
 
-static inline void
-yline(struct fb *fb, uint32_t x, uint32_t y1, uint32_t y2,
-      struct color c) {
-	while (y1 <= y2) pixel(fb, x, y1++, c);
+static void clear_box(struct fb *fb, const struct box *b) {
+	auto bpp = pixfmt_bpp(fb->pixfmt);
+	for (int32_t i = b->x1; i < b->x2; i++)
+		memset(fb->data+i*fb->pitch+b->y1*bpp, 0, (b->y2-b->y1)*bpp);
 }
 
-
-void render_object(struct object *obj) {
+// Returns true if the object's content has changed
+bool render_object(struct object *obj) {
 	bool need_rerender = obj->need_render;
 	if (!obj->render) {
 		assert(obj->fb.data == NULL);
-		return;
+		return false;
 	}
 	if (C(obj->w) || C(obj->h)) {
 		need_rerender = true;
-		free(obj->fb.data);
-		obj->fb.data = NULL;
+		fb_release(&obj->fb);
 	}
 	for (int i = 0; i < obj->nparams; i++)
 		if (C(obj->param[i])) {
@@ -108,31 +74,261 @@ void render_object(struct object *obj) {
 			break;
 		}
 	if (need_rerender) {
-		if (!obj->fb.data) {
-			obj->fb.width = V(obj->w);
-			obj->fb.pitch = obj->fb.width*pixfmt_bpp(obj->fb.pixfmt);
-			obj->fb.height = V(obj->h);
-			obj->fb.data = calloc(obj->fb.height*obj->fb.pitch, 1);
-		}
-		obj->render(obj);
+		// Objects with draw() don't need a fb of their own
+		if (!obj->draw && !obj->fb.data &&
+		    !fb_alloc(&obj->fb, V(obj->w), V(obj->h), obj->fb.pixfmt))
+			return false;
+		// render() can tell us better, or ask to be rendered again
+		obj->opaque = obj->fb.pixfmt == XRGB8888 && !obj->draw;
 		obj->need_render = false;
+		obj->render(obj);
+	}
+	return need_rerender;
+}
+
+static inline struct box object_box(struct object *o) {
+	int32_t x, y;
+	if (o->draw) {
+		x = V(o->x);
+		y = V(o->y);
+		return (struct box){ x, y, x+(int32_t)V(o->h), y+(int32_t)V(o->w) };
+	}
+	if (!o->fb.data)
+		return (struct box){0};
+	x = V(o->x);
+	y = V(o->y);
+	return (struct box){ x, y, x+o->fb.height, y+o->fb.width };
+}
+
+// The screen is split into TILE_SIZE squares. Every object is binned into
+// the damaged tiles it touches, in layer order, then tiles are composited
+// independently on the worker pool.
+#define TILE_SIZE 128
+
+struct tile {
+	struct box box;
+	bool damaged;
+	int nobj, cap;
+	struct object **obj;
+	// Scratch space for composite_tile(), the visible part of obj[i]
+	struct box *vis;
+};
+
+static struct {
+	struct tile *tile;
+	int rows, cols;
+	int32_t w, h;
+	int *active, nactive;
+} tiles;
+
+static struct workers *workers;
+
+void render_set_threads(int nthreads) {
+	workers_free(workers);
+	workers = nthreads > 1 ? workers_new(nthreads) : NULL;
+}
+
+static void tiles_resize(int32_t w, int32_t h) {
+	if (tiles.tile && tiles.w == w && tiles.h == h)
+		return;
+
+	for (int i = 0; i < tiles.rows*tiles.cols; i++) {
+		free(tiles.tile[i].obj);
+		free(tiles.tile[i].vis);
+	}
+	free(tiles.tile);
+	free(tiles.active);
+
+	tiles.w = w;
+	tiles.h = h;
+	tiles.rows = (h+TILE_SIZE-1)/TILE_SIZE;
+	tiles.cols = (w+TILE_SIZE-1)/TILE_SIZE;
+	tiles.tile = tmalloc(struct tile, tiles.rows*tiles.cols);
+	tiles.active = tmalloc(int, tiles.rows*tiles.cols);
+	for (int i = 0; i < tiles.rows; i++)
+		for (int j = 0; j < tiles.cols; j++)
+			tiles.tile[i*tiles.cols+j].box = (struct box){
+				i*TILE_SIZE, j*TILE_SIZE,
+				i*TILE_SIZE+TILE_SIZE < h ? i*TILE_SIZE+TILE_SIZE : h,
+				j*TILE_SIZE+TILE_SIZE < w ? j*TILE_SIZE+TILE_SIZE : w,
+			};
+}
+
+// Tiles covered by b, rows [r1, r2) and columns [c1, c2). b must be on
+// screen and not empty.
+static inline void
+tile_range(const struct box *b, int *r1, int *c1, int *r2, int *c2) {
+	*r1 = b->x1/TILE_SIZE;
+	*c1 = b->y1/TILE_SIZE;
+	*r2 = (b->x2-1)/TILE_SIZE+1;
+	*c2 = (b->y2-1)/TILE_SIZE+1;
+}
+
+static void tile_add(struct tile *t, struct object *o) {
+	if (t->nobj == t->cap) {
+		t->cap = t->cap ? t->cap*2 : 8;
+		t->obj = realloc(t->obj, sizeof(struct object *)*t->cap);
+		t->vis = realloc(t->vis, sizeof(struct box)*t->cap);
+	}
+	t->obj[t->nobj++] = o;
+}
+
+struct composite_job {
+	struct fb *fb;
+	const struct region *damage;
+};
+
+// Take the part of b hidden by o away from b, if what's left is still a
+// box. Otherwise b is left alone.
+static inline void box_occlude(struct box *b, const struct box *o) {
+	bool rows = o->x1 <= b->x1 && o->x2 >= b->x2,
+	     cols = o->y1 <= b->y1 && o->y2 >= b->y2;
+	if (cols) {
+		if (o->x1 <= b->x1 && o->x2 > b->x1)
+			b->x1 = o->x2 < b->x2 ? o->x2 : b->x2;
+		else if (o->x2 >= b->x2 && o->x1 < b->x2)
+			b->x2 = o->x1 > b->x1 ? o->x1 : b->x1;
+	} else if (rows) {
+		if (o->y1 <= b->y1 && o->y2 > b->y1)
+			b->y1 = o->y2 < b->y2 ? o->y2 : b->y2;
+		else if (o->y2 >= b->y2 && o->y1 < b->y2)
+			b->y2 = o->y1 > b->y1 ? o->y1 : b->y1;
+	}
+}
+
+// Runs on worker threads, must not evaluate any var
+static void composite_tile(int job, void *ud) {
+	struct composite_job *cj = ud;
+	auto t = &tiles.tile[tiles.active[job]];
+	for (int i = 0; i < cj->damage->nbox; i++) {
+		struct box clip;
+		if (!box_intersect(&cj->damage->box[i], &t->box, &clip))
+			continue;
+
+		// Front to back: whatever an opaque object covers doesn't
+		// have to be drawn for the objects below it.
+		int bottom = 0;
+		for (int j = t->nobj-1; j >= 0; j--) {
+			auto o = t->obj[j];
+			t->vis[j] = clip;
+			if (o->opaque)
+				box_occlude(&clip, &o->drawn);
+			if (box_empty(&clip)) {
+				bottom = j;
+				break;
+			}
+		}
+
+		// clip is now what no opaque object covers
+		if (!box_empty(&clip))
+			clear_box(cj->fb, &clip);
+		for (int j = bottom; j < t->nobj; j++) {
+			auto o = t->obj[j];
+			uint64_t tr = trace_begin();
+			if (o->draw) {
+				o->draw(o, cj->fb, &t->vis[j]);
+				trace_end("draw", tr);
+			} else {
+				blit_clipped(cj->fb, &o->fb, o->drawn.x1, o->drawn.y1, &t->vis[j]);
+				trace_end("blit", tr);
+			}
+		}
 	}
 }
 
-void render_scene(struct fb *fb, struct scene *s) {
+static void bin_objects(struct scene *s) {
+	struct box screen = { 0, 0, tiles.h, tiles.w };
+	int r1, c1, r2, c2;
+
+	tiles.nactive = 0;
+	for (int i = 0; i < tiles.rows*tiles.cols; i++) {
+		tiles.tile[i].damaged = false;
+		tiles.tile[i].nobj = 0;
+	}
+	for (int i = 0; i < s->damage.nbox; i++) {
+		tile_range(&s->damage.box[i], &r1, &c1, &r2, &c2);
+		for (int r = r1; r < r2; r++)
+			for (int c = c1; c < c2; c++) {
+				auto t = &tiles.tile[r*tiles.cols+c];
+				if (!t->damaged) {
+					t->damaged = true;
+					tiles.active[tiles.nactive++] = r*tiles.cols+c;
+				}
+			}
+	}
+	if (!tiles.nactive)
+		return;
+
 	for (int i = 0; i < s->nlayers; i++) {
 		struct object *o;
 		list_for_each_entry(o, &s->layer[i], siblings) {
-			render_object(o);
-			if (o->fb.data)
-				blit(fb, &o->fb, V(o->x), V(o->y));
+			struct box b;
+			if (!box_intersect(&o->drawn, &screen, &b))
+				continue;
+			tile_range(&b, &r1, &c1, &r2, &c2);
+			for (int r = r1; r < r2; r++)
+				for (int c = c1; c < c2; c++) {
+					auto t = &tiles.tile[r*tiles.cols+c];
+					if (t->damaged)
+						tile_add(t, o);
+				}
 		}
 	}
 }
 
+// Only the parts of fb that changed since the last render_scene() into
+// the same fb are repainted. Returns the damaged region, which stays
+// valid until the next render_scene().
+const struct region *render_scene(struct fb *fb, struct scene *s) {
+	struct box screen = { 0, 0, fb->height, fb->width };
+	bool full = fb->data != s->target || fb->width != s->target_w ||
+	            fb->height != s->target_h;
+
+	if (s->tape)
+		tape_eval(s->tape);
+
+	s->pending = false;
+	region_clear(&s->damage);
+	for (int i = 0; i < s->nlayers; i++) {
+		struct object *o;
+		list_for_each_entry(o, &s->layer[i], siblings) {
+			if (o->tracked && !o->dirty && !o->need_render && !full)
+				continue;
+			o->dirty = false;
+
+			uint64_t tr = trace_begin();
+			bool changed = render_object(o);
+			trace_end("render_object", tr);
+			if (o->need_render)
+				s->pending = true;
+			auto b = object_box(o);
+			if (!full && (changed || !box_eq(&b, &o->drawn))) {
+				region_add_box(&s->damage, &o->drawn);
+				region_add_box(&s->damage, &b);
+			}
+			o->drawn = b;
+		}
+	}
+	if (full)
+		region_add_box(&s->damage, &screen);
+	region_clip(&s->damage, &screen);
+
+	tiles_resize(fb->width, fb->height);
+	bin_objects(s);
+	struct composite_job cj = { fb, &s->damage };
+	workers_run(workers, tiles.nactive, composite_tile, &cj);
+
+	s->target = fb->data;
+	s->target_w = fb->width;
+	s->target_h = fb->height;
+	return &s->damage;
+}
+
 struct rect {
 	struct object base;
 	var *r, *g, *b, *a;
+	// Premultiplied colour, updated by prepare_rect()
+	uint32_t pixel;
 };
 
 static inline double color_clamp(double in) {
@@ -141,98 +337,149 @@ static inline double color_clamp(double in) {
 	return in;
 }
 
-static void render_rect(struct object *_o) {
+static inline uint32_t premultiply(var *rv, var *gv, var *bv, var *av) {
+	double r = color_clamp(V(rv)),
+	       g = color_clamp(V(gv)),
+	       b = color_clamp(V(bv)),
+	       a = color_clamp(V(av));
+	return (uint32_t)a<<24 | (uint32_t)(r*a/255.0)<<16 |
+	       (uint32_t)(g*a/255.0)<<8 | (uint32_t)(b*a/255.0);
+}
+
+static void prepare_rect(struct object *_o) {
 	struct rect *o = (void *)_o;
-	double r = color_clamp(V(o->r)),
-	       g = color_clamp(V(o->g)),
-	       b = color_clamp(V(o->b)),
-	       a = color_clamp(V(o->a));
-
-	uint8_t *data = o->base.fb.data;
-
-	for (uint32_t i = 0; i < V(o->base.h); i++) {
-		uint32_t ba = i*_o->fb.pitch;
-		for (uint32_t j = 0; j < V(o->base.w); j++) {
-			data[ba+j*4] = b*a/255.0;
-			data[ba+j*4+1] = g*a/255.0;
-			data[ba+j*4+2] = r*a/255.0;
-			data[ba+j*4+3] = a;
-		}
-	}
+	o->pixel = premultiply(o->r, o->g, o->b, o->a);
+	_o->opaque = (o->pixel>>24) == 255;
 }
 
-struct circle {
+static void draw_rect(struct object *_o, struct fb *fb, const struct box *clip) {
+	struct rect *o = (void *)_o;
+	struct box b;
+	if (!box_intersect(&_o->drawn, clip, &b) || !(o->pixel>>24))
+		return;
+
+	auto f = o->pixel>>24 == 255 ? blend->fill : blend->over_solid;
+	for (int32_t i = b.x1; i < b.x2; i++)
+		f((uint32_t *)(fb->data+i*fb->pitch)+b.y1, o->pixel, b.y2-b.y1);
+}
+
+// Circles, ellipses and rounded rects, filled, or outlined when
+// thickness > 0
+struct shape_object {
 	struct object base;
 	var *r, *g, *b, *a;
 	var *thickness;
+	var *radius; // rounded rects only
+	enum shape_kind kind;
+	bool circle; // stay round when w != h
+
+	// Coverage, and the geometry it was built for. Only rebuilt when
+	// the geometry changes, a new colour just repaints it.
+	struct coverage cov;
+	int32_t cov_w, cov_h;
+	double cov_th, cov_radius;
 };
 
-static void render_circle(struct object *o) {
-	fprintf(stderr, "render circle\n");
-	struct circle *ci = (void *)o;
+static void render_shape(struct object *o) {
+	struct shape_object *so = (void *)o;
 	struct fb *fb = &o->fb;
-	int th = V(ci->thickness);
-	int ro = fminf(V(o->w), V(o->h))/2.0-1;
-	int xo = ro;
-	int xi = ro-th;
-	int y = 0;
-	int erro = 1 - xo;
-	int erri = 1 - xi;
-
-	struct color c = {
-		.r = color_clamp(V(ci->r)),
-		.g = color_clamp(V(ci->g)),
-		.b = color_clamp(V(ci->b)),
-		.a = color_clamp(V(ci->a))
-	};
-
-	while(xo >= y) {
-		xline(fb, ro+xi, ro+xo, ro+y,  c);
-		yline(fb, ro+y,  ro+xi, ro+xo, c);
-		xline(fb, ro-xo, ro-xi, ro+y,  c);
-		yline(fb, ro-y,  ro+xi, ro+xo, c);
-		xline(fb, ro-xo, ro-xi, ro-y,  c);
-		yline(fb, ro-y,  ro-xo, ro-xi, c);
-		xline(fb, ro+xi, ro+xo, ro-y,  c);
-		yline(fb, ro+y,  ro-xo, ro-xi, c);
-
-		y++;
-
-		if (erro < 0) {
-			erro += 2*y+1;
-		} else {
-			xo--;
-			erro += 2*(y-xo+1);
-		}
-
-		if (y > ro-th) {
-			xi = y;
-		} else {
-			if (erri < 0) {
-				erri += 2*y+1;
-			} else {
-				xi--;
-				erri += 2*(y-xi+1);
-			}
-		}
+	double th = V(so->thickness), radius = so->radius ? V(so->radius) : 0;
+
+	if (fb->width != so->cov_w || fb->height != so->cov_h ||
+	    th != so->cov_th || radius != so->cov_radius) {
+		struct shape outer = { so->kind, fb->width/2.0, fb->height/2.0, 0 };
+		if (so->circle)
+			outer.hw = outer.hh = fmin(outer.hw, outer.hh);
+		outer.radius = fmax(fmin(radius, fmin(outer.hw, outer.hh)), 0);
+		struct shape inner = outer;
+		inner.hw -= th;
+		inner.hh -= th;
+		inner.radius = fmax(outer.radius-th, 0);
+		raster_shape(&so->cov, fb->width, fb->height, &outer, th > 0 ? &inner : NULL);
+
+		for (int32_t i = 0; i < fb->height; i++)
+			memset(fb->data+i*fb->pitch, 0, fb->width*pixfmt_bpp(fb->pixfmt));
+		so->cov_w = fb->width;
+		so->cov_h = fb->height;
+		so->cov_th = th;
+		so->cov_radius = radius;
 	}
+	raster_paint(fb, &so->cov, premultiply(so->r, so->g, so->b, so->a));
 }
 
+static void destroy_shape(struct object *o) {
+	coverage_fini(&((struct shape_object *)o)->cov);
+}
+
+// While the size is animating, a cheap bilinear resample from the source's
+// mip chain is redone every frame. Once it settles, the high quality one
+// is fetched from the resample cache.
 struct scale {
 	struct object base;
 	struct fb *fb;
+	struct resample_entry *hq;
+	struct fb fast;
+	const struct fb *cur;
 };
 
+// Only hides what's below if there is an image to draw, and it covers the
+// whole object
+static bool scale_opaque(struct scale *o, int32_t w, int32_t h) {
+	return o->fb->opaque && o->cur && o->cur->width >= w && o->cur->height >= h;
+}
+
 static void render_scale(struct object *_o) {
 	struct scale *o = (void *)_o;
-	stbir_resize_uint8_generic(o->fb->data, o->fb->width, o->fb->height, 0,
-	                           o->base.fb.data, o->base.fb.width, o->base.fb.height, 0,
-	                           4, 0, STBIR_FLAG_ALPHA_PREMULTIPLIED, STBIR_EDGE_CLAMP,
-	                           STBIR_FILTER_DEFAULT, STBIR_COLORSPACE_LINEAR, NULL);
+	int32_t w = V(_o->w), h = V(_o->h);
+	_o->opaque = false;
+	if (C(_o->w) || C(_o->h)) {
+		if (!o->fast.data || o->fast.width != w || o->fast.height != h) {
+			fb_release(&o->fast);
+			if (!fb_alloc(&o->fast, w, h, o->fb->pixfmt)) {
+				o->cur = NULL;
+				return;
+			}
+		}
+		resample_bilinear(&o->fast, o->fb);
+		o->cur = &o->fast;
+		_o->opaque = scale_opaque(o, w, h);
+		_o->need_render = true;
+		return;
+	}
+
+	auto hq = resample_get(o->fb, w, h, RESAMPLE_HQ);
+	resample_put(o->hq);
+	o->hq = hq;
+	o->cur = hq ? resample_entry_fb(hq) : NULL;
+	_o->opaque = scale_opaque(o, w, h);
+	fb_release(&o->fast);
+}
+
+static void destroy_scale(struct object *_o) {
+	struct scale *o = (void *)_o;
+	resample_put(o->hq);
+	fb_release(&o->fast);
+}
+
+static void draw_scale(struct object *_o, struct fb *fb, const struct box *clip) {
+	struct scale *o = (void *)_o;
+	if (o->cur)
+		blit_clipped(fb, o->cur, _o->drawn.x1, _o->drawn.y1, clip);
+}
+
+static void object_destroy(void *_o) {
+	struct object *o = _o;
+	if (o->destroy)
+		o->destroy(o);
+	fb_release(&o->fb);
 }
 
-struct object *new_obj(var *x, var *y, var *w, var *h, int nparams) {
-	struct object *ret = calloc(1, sizeof(struct object)+sizeof(var*)*nparams);
+// size is the size of the containing struct, which must have room for
+// nparams params
+struct object *new_obj(size_t size, var *x, var *y, var *w, var *h, int nparams) {
+	assert(size >= sizeof(struct object)+sizeof(var*)*nparams);
+	struct object *ret = arena_zalloc(size);
+	arena_defer_current(object_destroy, ret);
 	ret->x = x;
 	ret->y = y;
 	ret->w = w;
@@ -245,37 +492,63 @@ struct object *new_obj(var *x, var *y, var *w, var *h, int nparams) {
 }
 
 struct object *new_ghost(var *x, var *y, var *w, var *h, void *ud) {
-	auto ret = new_obj(x, y, w, h, 0);
+	auto ret = new_obj(sizeof(struct object), x, y, w, h, 0);
 	ret->user_data = ud;
 	return ret;
 }
 
 struct object *new_rect(var *x, var *y, var *w, var *h, var *r, var *g, var *b, var *a) {
-	struct rect *n = (void *)new_obj(x, y, w, h, 4);
+	struct rect *n = (void *)new_obj(sizeof(struct rect), x, y, w, h, 4);
 	n->r = r;
 	n->g = g;
 	n->b = b;
 	n->a = a;
-	n->base.render = render_rect;
+	n->base.render = prepare_rect;
+	n->base.draw = draw_rect;
 	return &n->base;
 }
 
 struct object *new_scale(var *x, var *y, var *w, var *h, struct fb *src) {
-	struct scale *s = (void *)new_obj(x, y, w, h, 0);
+	struct scale *s = (void *)new_obj(sizeof(struct scale), x, y, w, h, 0);
 	s->fb = src;
 	s->base.render = render_scale;
+	s->base.draw = draw_scale;
+	s->base.destroy = destroy_scale;
+	s->base.fb.pixfmt = ARGB8888;
 	return &s->base;
 }
 
+static struct shape_object *
+new_shape(var *x, var *y, var *w, var *h, var *r, var *g, var *b, var *a,
+          var *th, var *radius, enum shape_kind kind) {
+	struct shape_object *so = (void *)new_obj(sizeof(struct shape_object),
+	                                          x, y, w, h, radius ? 6 : 5);
+	so->r = r;
+	so->g = g;
+	so->b = b;
+	so->a = a;
+	so->thickness = th;
+	so->radius = radius;
+	so->kind = kind;
+	so->base.render = render_shape;
+	so->base.destroy = destroy_shape;
+	so->base.fb.pixfmt = ARGB8888;
+	return so;
+}
+
 struct object *new_circle(var *x, var *y, var *w, var *h, var *r, var *g, var *b, var *a, var *th) {
-	struct circle *c = (void *)new_obj(x, y, w, h, 5);
-	c->r = r;
-	c->g = g;
-	c->b = b;
-	c->a = a;
-	c->thickness = th;
-	c->base.render = render_circle;
-	return &c->base;
+	auto so = new_shape(x, y, w, h, r, g, b, a, th, NULL, SHAPE_ELLIPSE);
+	so->circle = true;
+	return &so->base;
+}
+
+struct object *new_ellipse(var *x, var *y, var *w, var *h, var *r, var *g, var *b, var *a, var *th) {
+	return &new_shape(x, y, w, h, r, g, b, a, th, NULL, SHAPE_ELLIPSE)->base;
+}
+
+struct object *new_rounded_rect(var *x, var *y, var *w, var *h, var *r, var *g, var *b, var *a,
+                                var *th, var *radius) {
+	return &new_shape(x, y, w, h, r, g, b, a, th, radius, SHAPE_ROUNDED_RECT)->base;
 }
 
 var **get_object_params(struct object *obj, int *nparams) {
@@ -284,10 +557,7 @@ var **get_object_params(struct object *obj, int *nparams) {
 }
 
 struct fb *new_similar_fb(const struct fb *old) {
-	auto ret = tmalloc(struct fb, 1);
-	*ret = *old;
-	ret->data = calloc(ret->pitch, ret->height);
-	return ret;
+	return new_fb(old->width, old->height, old->pixfmt);
 }
 
 void add_object_to_layer(struct object *o, struct list_head *l) {
@@ -1,6 +1,7 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
 
 #include "common.h"
 
@@ -25,15 +26,28 @@ struct fb {
 	int32_t width;
 
 	enum pixfmt pixfmt;
+	// All pixels have alpha == 255, or pixfmt has no alpha
+	bool opaque;
 };
 
 #define POS_PARAMS var *x, var *y, var *w, var *h
 
 struct scene;
 struct object;
-void render_scene(struct fb *, struct scene *);
+struct box;
+struct region;
+const struct region *render_scene(struct fb *, struct scene *);
+// Number of threads render_scene() composites with, 1 by default
+void render_set_threads(int);
+void blit(const struct fb *bottom, const struct fb *top, int32_t x, int32_t y);
+void blit_clipped(const struct fb *bottom, const struct fb *top,
+                  int32_t x, int32_t y, const struct box *clip);
 struct object *new_rect(POS_PARAMS, var *r, var *g, var *b, var *a);
+// Shapes are outlined with thickness if it's > 0, filled otherwise
 struct object *new_circle(POS_PARAMS, var *r, var *g, var *b, var *a, var *thickness);
+struct object *new_ellipse(POS_PARAMS, var *r, var *g, var *b, var *a, var *thickness);
+struct object *new_rounded_rect(POS_PARAMS, var *r, var *g, var *b, var *a,
+                                var *thickness, var *radius);
 struct object *new_ghost(POS_PARAMS, void *ud);
 struct object *new_scale(POS_PARAMS, struct fb *src);
 struct scene *new_scene(int nlayers);
@@ -46,12 +60,22 @@ static inline bool pixfmt_compat(uint8_t p1, uint8_t p2) {
 	return true;
 }
 
+// Allocate zeroed pixel storage for fb from the fb pool, and fill in its
+// geometry. Rows are padded to FB_ALIGN bytes.
+bool fb_alloc(struct fb *, int32_t w, int32_t h, enum pixfmt);
+// Give fb's pixels back to the pool
+void fb_release(struct fb *);
+
 static inline struct fb* new_fb(int32_t w, int32_t h, enum pixfmt pixfmt) {
 	auto ret = tmalloc(struct fb, 1);
-	ret->width = w;
-	ret->height = h;
-	ret->pitch = w*pixfmt_bpp(pixfmt);
-	ret->pixfmt = pixfmt;
-	ret->data = calloc(1, ret->pitch*h);
+	if (!fb_alloc(ret, w, h, pixfmt)) {
+		free(ret);
+		return NULL;
+	}
 	return ret;
 }
+
+static inline void free_fb(struct fb *fb) {
+	fb_release(fb);
+	free(fb);
+}
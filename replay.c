@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+#include "replay.h"
+
+struct replay {
+	struct replay_event *ev;
+	size_t nev, cap, next;
+	size_t nframes;
+};
+
+static bool parse_line(const char *line, struct replay_event *e) {
+	*e = (struct replay_event){0};
+	int pressed;
+	unsigned state;
+	switch (line[0]) {
+	case 'F':
+		e->kind = REPLAY_FRAME;
+		return sscanf(line+1, "%lf", &e->t) == 1;
+	case 'M':
+		e->kind = REPLAY_MOVE;
+		return sscanf(line+1, "%lf %u %u", &e->t, &e->x, &e->y) == 3;
+	case 'B':
+		e->kind = REPLAY_BUTTON;
+		if (sscanf(line+1, "%lf %d %u %d", &e->t, &e->button, &state, &pressed) != 4)
+			return false;
+		e->state = state;
+		e->pressed = pressed;
+		return true;
+	default:
+		return false;
+	}
+}
+
+struct replay *replay_open(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	auto r = tmalloc(struct replay, 1);
+	char line[256];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (line[0] == '\n' || line[0] == '#')
+			continue;
+		if (r->nev == r->cap) {
+			r->cap = r->cap ? r->cap*2 : 1024;
+			r->ev = realloc(r->ev, sizeof(struct replay_event)*r->cap);
+		}
+		auto e = &r->ev[r->nev];
+		if (!parse_line(line, e)) {
+			fprintf(stderr, "%s:%d: bad event\n", path, lineno);
+			fclose(f);
+			replay_close(r);
+			return NULL;
+		}
+		if (e->kind == REPLAY_FRAME)
+			r->nframes++;
+		r->nev++;
+	}
+	fclose(f);
+	return r;
+}
+
+bool replay_next(struct replay *r, struct replay_event *e) {
+	if (r->next >= r->nev)
+		return false;
+	*e = r->ev[r->next++];
+	return true;
+}
+
+size_t replay_nframes(const struct replay *r) {
+	return r->nframes;
+}
+
+void replay_close(struct replay *r) {
+	if (!r)
+		return;
+	free(r->ev);
+	free(r);
+}
+
+FILE *record_open(const char *path) {
+	FILE *f = fopen(path, "w");
+	if (!f)
+		fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+	return f;
+}
+
+void record_event(FILE *f, const struct replay_event *e) {
+	switch (e->kind) {
+	case REPLAY_FRAME:
+		fprintf(f, "F %.9f\n", e->t);
+		// Once a frame, so a crash loses at most the last frame's input
+		fflush(f);
+		break;
+	case REPLAY_MOVE:
+		fprintf(f, "M %.9f %u %u\n", e->t, e->x, e->y);
+		break;
+	case REPLAY_BUTTON:
+		fprintf(f, "B %.9f %d %u %d\n", e->t, e->button, e->state, e->pressed);
+		break;
+	}
+}
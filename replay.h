@@ -0,0 +1,39 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Recording and replaying of input events and frame times, so a session
+// can be rerun exactly. The log is plain text, one event per line:
+//
+//	F <t>                             a frame rendered at time t
+//	M <t> <x> <y>                     pointer moved
+//	B <t> <button> <state> <pressed>  button changed
+//
+// t is in seconds since the first frame was rendered.
+
+enum replay_kind {
+	REPLAY_FRAME,
+	REPLAY_MOVE,
+	REPLAY_BUTTON,
+};
+
+struct replay_event {
+	enum replay_kind kind;
+	double t;
+	uint32_t x, y;
+	int button;
+	uint16_t state;
+	bool pressed;
+};
+
+struct replay;
+// Reads the whole log, NULL if it can't be read or is malformed
+struct replay *replay_open(const char *path);
+// False once all events are used up
+bool replay_next(struct replay *, struct replay_event *);
+size_t replay_nframes(const struct replay *);
+void replay_close(struct replay *);
+
+FILE *record_open(const char *path);
+void record_event(FILE *, const struct replay_event *);
@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESAMPLE_X86
+#endif
+
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#include <stb/stb_image_resize.h>
+
+#include "common.h"
+#include "list.h"
+#include "render.h"
+#include "resample.h"
+
+// Resampled images not in use are evicted, least recently used first,
+// once the cache holds more than this
+#define CACHE_BUDGET (64u<<20)
+#define MIP_MAX 16
+
+struct resample_entry {
+	const struct fb *src;
+	int32_t w, h;
+	enum resample_filter filter;
+	struct fb fb;
+	int refs;
+	struct list_head siblings;
+};
+
+// Each level is half the size of the one before, level 0 is the source
+struct mip_chain {
+	const struct fb *src;
+	struct fb level[MIP_MAX];
+	int nlevels;
+	struct list_head siblings;
+};
+
+static struct {
+	struct list_head lru; // most recently used first
+	struct list_head mips;
+	size_t bytes;
+	uint64_t hits, misses, evictions;
+	bool init;
+} cache;
+
+static void cache_init(void) {
+	if (cache.init)
+		return;
+	INIT_LIST_HEAD(&cache.lru);
+	INIT_LIST_HEAD(&cache.mips);
+	cache.init = true;
+}
+
+static inline size_t fb_bytes(const struct fb *fb) {
+	return (size_t)fb->pitch*fb->height;
+}
+
+static void entry_free(struct resample_entry *e) {
+	list_del(&e->siblings);
+	cache.bytes -= fb_bytes(&e->fb);
+	fb_release(&e->fb);
+	free(e);
+}
+
+static void cache_evict(void) {
+	struct resample_entry *e, *tmp;
+	list_for_each_entry_safe_reverse(e, tmp, &cache.lru, siblings) {
+		if (cache.bytes <= CACHE_BUDGET)
+			break;
+		if (e->refs)
+			continue;
+		entry_free(e);
+		cache.evictions++;
+	}
+}
+
+// 2x2 box filter, odd sizes clamp at the edge
+static void downsample(struct fb *dst, const struct fb *src) {
+	for (int32_t i = 0; i < dst->height; i++) {
+		const uint8_t *r0 = src->data+(2*i)*src->pitch;
+		const uint8_t *r1 = 2*i+1 < src->height ? r0+src->pitch : r0;
+		uint8_t *d = dst->data+i*dst->pitch;
+		for (int32_t j = 0; j < dst->width; j++) {
+			int32_t j0 = 2*j*4, j1 = 2*j+1 < src->width ? j0+4 : j0;
+			for (int c = 0; c < 4; c++)
+				d[j*4+c] = (r0[j0+c]+r0[j1+c]+r1[j0+c]+r1[j1+c]+2)/4;
+		}
+	}
+}
+
+static struct mip_chain *mip_get(const struct fb *src) {
+	struct mip_chain *m;
+	list_for_each_entry(m, &cache.mips, siblings)
+		if (m->src == src)
+			return m;
+
+	m = tmalloc(struct mip_chain, 1);
+	m->src = src;
+	m->level[0] = *src;
+	m->nlevels = 1;
+	while (m->nlevels < MIP_MAX) {
+		auto prev = &m->level[m->nlevels-1];
+		if (prev->width == 1 && prev->height == 1)
+			break;
+		auto next = &m->level[m->nlevels];
+		if (!fb_alloc(next, prev->width > 1 ? prev->width/2 : 1,
+		              prev->height > 1 ? prev->height/2 : 1, src->pixfmt))
+			break;
+		downsample(next, prev);
+		m->nlevels++;
+	}
+	list_add(&m->siblings, &cache.mips);
+	return m;
+}
+
+// Source position and weight, in 1/256th of a pixel, for each of the
+// dst pixels along one axis. Pixel centers line up at the edges.
+static void
+compute_taps(int32_t *pos, int32_t *frac, int32_t dst, int32_t src) {
+	for (int32_t i = 0; i < dst; i++) {
+		double s = (i+0.5)*src/dst-0.5;
+		if (s < 0)
+			s = 0;
+		int32_t p = s;
+		int32_t f = (s-p)*256+0.5;
+		if (p >= src-1) {
+			// Keep p+1 inside the image
+			p = src > 1 ? src-2 : 0;
+			f = src > 1 ? 256 : 0;
+		}
+		pos[i] = p;
+		frac[i] = f;
+	}
+}
+
+// Rounds the same way as the SIMD kernel: vertical first, back to 8 bits,
+// then horizontal
+static inline uint32_t
+bilinear_px_scalar(const uint8_t *r0, const uint8_t *r1, int32_t fx, int32_t fy) {
+	uint32_t ret = 0;
+	for (int c = 0; c < 4; c++) {
+		uint32_t l = (r0[c]*(256-fy)+r1[c]*fy+128)>>8,
+		         r = (r0[c+4]*(256-fy)+r1[c+4]*fy+128)>>8;
+		ret |= ((l*(256-fx)+r*fx+128)>>8)<<(c*8);
+	}
+	return ret;
+}
+
+// Sources one pixel wide have no right neighbour
+static inline uint32_t
+bilinear_col_scalar(const uint8_t *r0, const uint8_t *r1, int32_t fy) {
+	uint32_t ret = 0;
+	for (int c = 0; c < 4; c++)
+		ret |= ((r0[c]*(256-fy)+r1[c]*fy+128)>>8)<<(c*8);
+	return ret;
+}
+
+static void
+bilinear_row_scalar(uint32_t *dst, const uint8_t *r0, const uint8_t *r1, int32_t fy,
+                    const int32_t *x, const int32_t *fx, int32_t n) {
+	for (int32_t j = 0; j < n; j++)
+		dst[j] = bilinear_px_scalar(r0+x[j]*4, r1+x[j]*4, fx[j], fy);
+}
+
+#ifdef RESAMPLE_X86
+// One pixel at a time, the 2x2 neighbourhood in two 64-bit loads
+__attribute__((target("sse2")))
+static void
+bilinear_row_sse2(uint32_t *dst, const uint8_t *r0, const uint8_t *r1, int32_t fy,
+                  const int32_t *x, const int32_t *fx, int32_t n) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i wy0 = _mm_set1_epi16(256-fy), wy1 = _mm_set1_epi16(fy);
+	for (int32_t j = 0; j < n; j++) {
+		__m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(r0+x[j]*4)), zero),
+		        b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(r1+x[j]*4)), zero);
+		// vertical, then horizontal, both with 8 bits of weight
+		__m128i v = _mm_add_epi16(_mm_mullo_epi16(a, wy0), _mm_mullo_epi16(b, wy1));
+		v = _mm_srli_epi16(_mm_add_epi16(v, _mm_set1_epi16(128)), 8);
+		__m128i wx = _mm_unpacklo_epi64(_mm_set1_epi16(256-fx[j]), _mm_set1_epi16(fx[j]));
+		v = _mm_mullo_epi16(v, wx);
+		v = _mm_add_epi16(v, _mm_srli_si128(v, 8));
+		v = _mm_srli_epi16(_mm_add_epi16(v, _mm_set1_epi16(128)), 8);
+		dst[j] = _mm_cvtsi128_si32(_mm_packus_epi16(v, zero));
+	}
+}
+#endif
+
+void resample_bilinear(struct fb *dst, const struct fb *src) {
+	if (!dst->width || !dst->height)
+		return;
+	cache_init();
+
+	// Smallest level still at least as big as dst, so bilinear never
+	// has to shrink by more than 2x
+	auto m = mip_get(src);
+	int l = 0;
+	while (l+1 < m->nlevels && m->level[l+1].width >= dst->width &&
+	       m->level[l+1].height >= dst->height)
+		l++;
+	auto s = &m->level[l];
+
+	int32_t *x = malloc(sizeof(int32_t)*dst->width*2), *fx = x+dst->width;
+	int32_t *y = malloc(sizeof(int32_t)*dst->height*2), *fy = y+dst->height;
+	compute_taps(x, fx, dst->width, s->width);
+	compute_taps(y, fy, dst->height, s->height);
+
+	auto row = bilinear_row_scalar;
+#ifdef RESAMPLE_X86
+	if (__builtin_cpu_supports("sse2"))
+		row = bilinear_row_sse2;
+#endif
+	for (int32_t i = 0; i < dst->height; i++) {
+		const uint8_t *r0 = s->data+y[i]*s->pitch,
+		              *r1 = s->height > 1 ? r0+s->pitch : r0;
+		auto d = (uint32_t *)(dst->data+i*dst->pitch);
+		if (s->width == 1) {
+			uint32_t px = bilinear_col_scalar(r0, r1, fy[i]);
+			for (int32_t j = 0; j < dst->width; j++)
+				d[j] = px;
+			continue;
+		}
+		row(d, r0, r1, fy[i], x, fx, dst->width);
+	}
+	free(x);
+	free(y);
+}
+
+static void resample_hq(struct fb *dst, const struct fb *src) {
+	stbir_resize_uint8_generic(src->data, src->width, src->height, src->pitch,
+	                           dst->data, dst->width, dst->height, dst->pitch,
+	                           4, 0, STBIR_FLAG_ALPHA_PREMULTIPLIED, STBIR_EDGE_CLAMP,
+	                           STBIR_FILTER_DEFAULT, STBIR_COLORSPACE_LINEAR, NULL);
+}
+
+struct resample_entry *
+resample_get(const struct fb *src, int32_t w, int32_t h, enum resample_filter filter) {
+	cache_init();
+	struct resample_entry *e;
+	list_for_each_entry(e, &cache.lru, siblings) {
+		if (e->src == src && e->w == w && e->h == h && e->filter == filter) {
+			list_move(&e->siblings, &cache.lru);
+			e->refs++;
+			cache.hits++;
+			return e;
+		}
+	}
+
+	cache.misses++;
+	e = tmalloc(struct resample_entry, 1);
+	if (!fb_alloc(&e->fb, w, h, src->pixfmt)) {
+		free(e);
+		return NULL;
+	}
+	e->src = src;
+	e->w = w;
+	e->h = h;
+	e->filter = filter;
+	e->refs = 1;
+	e->fb.opaque = src->opaque;
+	if (filter == RESAMPLE_HQ)
+		resample_hq(&e->fb, src);
+	else
+		resample_bilinear(&e->fb, src);
+
+	list_add(&e->siblings, &cache.lru);
+	cache.bytes += fb_bytes(&e->fb);
+	cache_evict();
+	return e;
+}
+
+const struct fb *resample_entry_fb(const struct resample_entry *e) {
+	return &e->fb;
+}
+
+void resample_put(struct resample_entry *e) {
+	if (!e)
+		return;
+	assert(e->refs > 0);
+	e->refs--;
+	cache_evict();
+}
+
+void resample_forget(const struct fb *src) {
+	cache_init();
+	struct resample_entry *e, *tmp;
+	list_for_each_entry_safe(e, tmp, &cache.lru, siblings) {
+		if (e->src != src)
+			continue;
+		assert(!e->refs);
+		entry_free(e);
+	}
+
+	struct mip_chain *m, *mtmp;
+	list_for_each_entry_safe(m, mtmp, &cache.mips, siblings) {
+		if (m->src != src)
+			continue;
+		for (int i = 1; i < m->nlevels; i++)
+			fb_release(&m->level[i]);
+		list_del(&m->siblings);
+		free(m);
+	}
+}
+
+void resample_dump_stats(FILE *f) {
+	uint64_t total = cache.hits+cache.misses;
+	fprintf(f, "resample cache: %lu lookups, %lu hits (%.1f%%), %lu evictions, "
+	        "%zu KiB cached\n", total, cache.hits,
+	        total ? 100.0*cache.hits/total : 0.0, cache.evictions, cache.bytes>>10);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+
+struct fb;
+
+enum resample_filter {
+	RESAMPLE_BILINEAR, // from the closest mip level, fast enough to do every frame
+	RESAMPLE_HQ,       // stbir's default filter, from the full size source
+};
+
+struct resample_entry;
+
+// src resampled to w x h, from the cache if possible. The entry stays
+// valid until it's given back with resample_put(). Returns NULL on
+// allocation failure.
+struct resample_entry *
+resample_get(const struct fb *src, int32_t w, int32_t h, enum resample_filter);
+const struct fb *resample_entry_fb(const struct resample_entry *);
+void resample_put(struct resample_entry *);
+
+// Bilinear resample of src into all of dst, picking the mip level of src
+// closest to dst's size
+void resample_bilinear(struct fb *dst, const struct fb *src);
+
+// Drop everything cached for src, it must not have entries in use
+void resample_forget(const struct fb *src);
+void resample_dump_stats(FILE *);
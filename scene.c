@@ -4,11 +4,17 @@
 #include "user.h"
 #include "object.h"
 #include "scene.h"
+#include "arena.h"
 struct mouse_handler {
 	void (*mouse_over)(struct object *, bool is_over);
 	void (*mouse_button)(struct object *, uint16_t state, int16_t button);
 };
 static const struct mouse_handler circle_hdlr;
+// user_data of the circle, it's used as a mouse_handler
+struct circle {
+	struct mouse_handler hdlr;
+	var *r;
+};
 struct scene_config {
 	uint32_t w, h;
 };
@@ -23,8 +29,14 @@ static void move_rect_0_cb(keyed *v, struct key_frame *k, bool finished, void *u
 	keyed_new_quadratic_key(v, scfg->h/2, 3, move_rect_center_cb, scfg);
 }
 
+static void scene_fini(void *s) {
+	region_fini(&((struct scene *)s)->damage);
+}
+
 struct scene *new_scene(int nlayers) {
-	struct scene *ret = calloc(1, sizeof(struct scene)+sizeof(struct list_head)*nlayers);
+	struct scene *ret = arena_zalloc(sizeof(struct scene)+sizeof(struct list_head)*nlayers);
+	ret->arena = arena_current();
+	arena_defer_current(scene_fini, ret);
 	ret->nlayers = nlayers;
 	for (int i = 0; i < nlayers; i++)
 		INIT_LIST_HEAD(&ret->layer[i]);
@@ -33,7 +45,7 @@ struct scene *new_scene(int nlayers) {
 struct scene *build_scene(struct interpolate_man *im, struct user *user, size_t nusers, uint32_t w, uint32_t h) {
 	for (int i = 0; i < nusers; i++)
 		fprintf(stderr, "user: %s\n", user[i].name);
-	auto scfg = tmalloc(struct scene_config, 1);
+	auto scfg = amalloc(struct scene_config, 1);
 	scfg->w = w;
 	scfg->h = h;
 	auto x = new_keyed(im, h/2);
@@ -52,8 +64,12 @@ struct scene *build_scene(struct interpolate_man *im, struct user *user, size_t
 	auto y4 = vADD(vNEG(y2), vC(w));
 	auto rect4 = new_rect(vC(h/2), y4, wv, wv, full, full, zero, full);
 
-	auto circle = new_circle(vC(h/2-125), vC(w/2-125), vC(250), vC(250), vC(255), vC(255), vC(255), vC(255), vC(1));
-	circle->user_data = (void *)&circle_hdlr;
+	auto cs = amalloc(struct circle, 1);
+	cs->hdlr = circle_hdlr;
+	cs->r = new_keyed(im, 255);
+	auto circle = new_circle(vC(h/2-125), vC(w/2-125), vC(250), vC(250), cs->r,
+	                         vC(255), vC(255), vC(255), vC(1));
+	circle->user_data = cs;
 
 	auto s = new_scene(1);
 	list_add(&rect->siblings, &s->layer[0]);
@@ -65,13 +81,12 @@ struct scene *build_scene(struct interpolate_man *im, struct user *user, size_t
 }
 
 void circle_over(struct object *obj, bool over) {
+	struct circle *c = obj->user_data;
 	fprintf(stderr, "circle over %d\n", over);
-	free(obj->param[0]);
-	if (over)
-		obj->param[0] = vC(0);
-	else
-		obj->param[0] = vC(255);
-	obj->need_render = true;
+	// A key frame that ends right away. It comes from the key frame slab,
+	// so hovering allocates nothing.
+	keyed_truncate((void *)c->r);
+	keyed_new_linear_key((void *)c->r, over ? 0 : 255, 0, NULL, NULL);
 }
 
 void circle_button(struct object *obj, uint16_t state, int16_t button) {
@@ -83,6 +98,78 @@ static const struct mouse_handler circle_hdlr = {
 	.mouse_button = circle_button,
 };
 
+void scene_invalidate(struct scene *s) {
+	// Forget what was rendered, so render_scene() repaints everything
+	s->target = NULL;
+	s->pending = true;
+	if (s->wake)
+		s->wake(s->wake_ud);
+}
+
+void scene_set_wake(struct scene *s, void (*wake)(void *ud), void *ud) {
+	s->wake = wake;
+	s->wake_ud = ud;
+}
+
+bool scene_pending(const struct scene *s) {
+	return s->pending;
+}
+
+static uint32_t walk_mark;
+
+// Find the vars under v that change on their own
+static void track_var(var *v, bool *dirty) {
+	if (v->mark == walk_mark)
+		return;
+	v->mark = walk_mark;
+
+	struct var_info info;
+	var_inspect(v, &info);
+	switch (info.kind) {
+	case VAR_CONST:
+		break;
+	case VAR_ARITH:
+		track_var(info.a, dirty);
+		if (info.b)
+			track_var(info.b, dirty);
+		break;
+	default:
+		var_add_dependent(v, dirty);
+		break;
+	}
+}
+
+void scene_free(struct scene *s) {
+	// Everything, the scene itself included, is in the arena
+	arena_free(s->arena);
+}
+
+void scene_track_deps(struct scene *s) {
+	// Tape vars hide what they are computed from
+	if (s->tape) {
+		fprintf(stderr, "Dependencies have to be tracked before the tape is compiled\n");
+		return;
+	}
+	auto prev = arena_set_current(s->arena);
+	for (int i = 0; i < s->nlayers; i++) {
+		struct object *o;
+		list_for_each_entry(o, &s->layer[i], siblings) {
+			// A new mark for every object, a var shared by two
+			// objects gets both of them
+			if (!++walk_mark)
+				walk_mark = 1;
+			track_var(o->x, &o->dirty);
+			track_var(o->y, &o->dirty);
+			track_var(o->w, &o->dirty);
+			track_var(o->h, &o->dirty);
+			for (int j = 0; j < o->nparams; j++)
+				track_var(o->param[j], &o->dirty);
+			o->tracked = true;
+		}
+	}
+	arena_set_current(prev);
+}
+
 struct object *get_object_at(struct scene *s, uint32_t x, uint32_t y) {
 	for (int i = s->nlayers-1; i >= 0; i--) {
 		struct object *o;
@@ -95,6 +182,15 @@ struct object *get_object_at(struct scene *s, uint32_t x, uint32_t y) {
 	return NULL;
 }
 
+void handle_mouse_button(struct scene *s, uint32_t x, uint32_t y, uint16_t state, int16_t button) {
+	auto obj = get_object_at(s, x, y);
+	if (!obj)
+		return;
+	struct mouse_handler *mh = obj->user_data;
+	if (mh && mh->mouse_button)
+		mh->mouse_button(obj, state, button);
+}
+
 void handle_mouse_move(struct scene *s, uint32_t x, uint32_t y) {
 	auto obj = get_object_at(s, x, y);
 	fprintf(stderr, "%u %u %p\n", x, y, obj);
@@ -1,10 +1,33 @@
 #pragma once
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 struct interpolate_man;
 struct user;
 struct scene;
+// Scenes, their objects and vars are allocated from the current arena,
+// see arena.h. The interpolate_man driving the scene should be made in
+// the same arena.
 struct scene *build_scene(struct interpolate_man *, struct user *, size_t nusers, uint32_t, uint32_t);
+// Free the scene's arena, and with it everything made while it was
+// current. Does nothing for scenes made without an arena.
+void scene_free(struct scene *);
+
+// Have the whole scene repainted on the next frame, for changes coral
+// can't see. Wakes the render loop up if it's idle.
+void scene_invalidate(struct scene *);
+// wake is called by scene_invalidate()
+void scene_set_wake(struct scene *, void (*wake)(void *ud), void *ud);
+// Whether the scene has to be rendered again even if no var changes
+bool scene_pending(const struct scene *);
+// Register every object with the vars it depends on, so render_scene()
+// only looks at objects whose vars changed. Has to be called once,
+// before tape_compile(), and vars given to objects later aren't tracked.
+void scene_track_deps(struct scene *);
+
+struct object;
+// Topmost object under (x, y), NULL if there is none
+struct object *get_object_at(struct scene *, uint32_t x, uint32_t y);
 
 // x -> x-th scanline from top, y -> y-th pixel from left
 void handle_mouse_move(struct scene *, uint32_t x, uint32_t y);
@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "common.h"
+#include "stats.h"
+
+static const char *const phase_names[NPHASES] = {
+	[PHASE_ADVANCE] = "advance",
+	[PHASE_RENDER] = "render",
+	[PHASE_UPLOAD] = "upload",
+	[PHASE_COMMIT] = "commit",
+	[PHASE_FLIP] = "flip",
+	[PHASE_LATENCY] = "latency",
+	[PHASE_INPUT] = "input",
+};
+
+// Histogram bucket upper bounds, in ms
+static const double buckets[] = { 0.5, 1, 2, 4, 8, 16, 33, 66 };
+#define NBUCKETS (ARR_LEN(buckets)+1)
+
+struct phase_stats {
+	double sample[STATS_WINDOW];
+	int nsample, next;
+	uint64_t count;
+	double total, max;
+};
+
+static struct {
+	struct phase_stats phase[NPHASES];
+	uint64_t frames, waiting, dropped, replaced, missed, idle;
+	uint64_t last_seq;
+	bool have_seq;
+	double queued_at;
+	// Start time and oldest unshown input of the newest frame, and of
+	// the frame handed to the display
+	double started_at, input_at, pending_input_at;
+	double queued_start, queued_input;
+} stats;
+
+double stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+void stats_record(enum stats_phase p, double seconds) {
+	auto ps = &stats.phase[p];
+	ps->sample[ps->next] = seconds;
+	ps->next = (ps->next+1)%STATS_WINDOW;
+	if (ps->nsample < STATS_WINDOW)
+		ps->nsample++;
+	ps->count++;
+	ps->total += seconds;
+	if (seconds > ps->max)
+		ps->max = seconds;
+}
+
+void stats_frame_start(double t) {
+	stats.started_at = t;
+	// If the last frame started was dropped or replaced, its input
+	// is shown by this one, and it came first
+	if (!stats.input_at)
+		stats.input_at = stats.pending_input_at;
+	stats.pending_input_at = 0;
+}
+
+void stats_input(double t) {
+	if (!stats.pending_input_at)
+		stats.pending_input_at = t;
+}
+
+void stats_queued(double t) {
+	stats.queued_at = t;
+	stats.queued_start = stats.started_at;
+	stats.queued_input = stats.input_at;
+	stats.input_at = 0;
+}
+
+void stats_dropped(void) {
+	stats.dropped++;
+}
+
+void stats_waiting(void) {
+	stats.waiting++;
+}
+
+void stats_replaced(void) {
+	stats.replaced++;
+}
+
+void stats_idle(void) {
+	stats.idle++;
+	stats.have_seq = false;
+}
+
+void stats_flip(uint64_t seq, double t) {
+	stats.frames++;
+	if (stats.queued_at > 0 && t >= stats.queued_at)
+		stats_record(PHASE_FLIP, t-stats.queued_at);
+	stats.queued_at = 0;
+	if (stats.queued_start > 0 && t >= stats.queued_start)
+		stats_record(PHASE_LATENCY, t-stats.queued_start);
+	if (stats.queued_input > 0 && t >= stats.queued_input)
+		stats_record(PHASE_INPUT, t-stats.queued_input);
+	stats.queued_start = stats.queued_input = 0;
+	if (stats.have_seq && seq > stats.last_seq+1)
+		stats.missed += seq-stats.last_seq-1;
+	stats.last_seq = seq;
+	stats.have_seq = true;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+void stats_dump(FILE *f) {
+	fprintf(f, "frames: %lu presented, %lu rendered ahead, %lu dropped, %lu replaced, "
+	        "%lu vblanks missed, idle %lu times\n", stats.frames, stats.waiting,
+	        stats.dropped, stats.replaced, stats.missed, stats.idle);
+	double sorted[STATS_WINDOW];
+	for (int i = 0; i < NPHASES; i++) {
+		auto ps = &stats.phase[i];
+		if (!ps->nsample)
+			continue;
+		for (int j = 0; j < ps->nsample; j++)
+			sorted[j] = ps->sample[j]*1e3;
+		qsort(sorted, ps->nsample, sizeof(double), cmp_double);
+		int n = ps->nsample;
+		fprintf(f, "%-8s n=%lu mean=%.3fms p50=%.3f p90=%.3f p99=%.3f max=%.3f"
+		        " (last %d: max %.3f)\n", phase_names[i], ps->count,
+		        ps->total*1e3/ps->count, sorted[n/2], sorted[n*9/10],
+		        sorted[n*99/100], ps->max*1e3, n, sorted[n-1]);
+
+		int hist[NBUCKETS] = {0}, b = 0;
+		for (int j = 0; j < n; j++) {
+			while (b < (int)ARR_LEN(buckets) && sorted[j] > buckets[b])
+				b++;
+			hist[b]++;
+		}
+		fprintf(f, "        ");
+		for (int j = 0; j < (int)NBUCKETS; j++) {
+			if (j < (int)ARR_LEN(buckets))
+				fprintf(f, " <=%gms:%d", buckets[j], hist[j]);
+			else
+				fprintf(f, " >%gms:%d", buckets[j-1], hist[j]);
+		}
+		fprintf(f, "\n");
+	}
+}
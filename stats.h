@@ -0,0 +1,45 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+
+// Per frame timing. Every phase keeps its last STATS_WINDOW samples, which
+// stats_dump() turns into percentiles and a histogram. Main thread only.
+
+#define STATS_WINDOW 600
+
+enum stats_phase {
+	PHASE_ADVANCE, // interpolate_man_advance()
+	PHASE_RENDER,  // render_scene()
+	PHASE_UPLOAD,  // copying the frame out to the backend's buffer
+	PHASE_COMMIT,  // atomic check and commit
+	PHASE_FLIP,    // from commit to the frame being on screen
+	PHASE_LATENCY, // from starting a frame to it being on screen
+	PHASE_INPUT,   // from an input event to the first frame showing it
+	NPHASES,
+};
+
+// CLOCK_MONOTONIC, in seconds. Page flip timestamps use the same clock.
+double stats_now(void);
+void stats_record(enum stats_phase, double seconds);
+
+// Rendering a frame started at time t, the state it shows is from then
+void stats_frame_start(double t);
+// An input event arrived at time t
+void stats_input(double t);
+// A frame was handed to the display at time t. That is the newest frame
+// started, any older one still waiting was dropped or replaced.
+void stats_queued(double t);
+// The backend was still busy, so a frame was thrown away
+void stats_dropped(void);
+// A frame was queued behind a pending flip, rendered ahead
+void stats_waiting(void);
+// A frame waiting for the display was replaced by a newer one
+void stats_replaced(void);
+// The queued frame went on screen at vblank seq, at time t. Vblanks that
+// passed since the previous flip without a new frame count as missed.
+void stats_flip(uint64_t seq, double t);
+// Rendering stopped because nothing changed, the vblanks until the next
+// flip aren't missed
+void stats_idle(void);
+
+void stats_dump(FILE *);
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "common.h"
+#include "object.h"
+#include "render.h"
+#include "resample.h"
+#include "arena.h"
+#include "synth.h"
+
+// Shared by all scale objects
+#define SYNTH_IMAGE_SIZE 256
+
+struct anim {
+	uint32_t seed;
+	double range, duration;
+};
+
+// xorshift32, the same sequence on every machine
+static uint32_t rnd(uint32_t *s) {
+	uint32_t x = *s;
+	x ^= x<<13;
+	x ^= x>>17;
+	x ^= x<<5;
+	return *s = x;
+}
+
+// Uniform in [0, 1)
+static double rndf(uint32_t *s) {
+	return rnd(s)/4294967296.0;
+}
+
+void synth_params_default(struct synth_params *p) {
+	*p = (struct synth_params){
+		.nobjects = 200,
+		.nlayers = 4,
+		.min_size = 16,
+		.max_size = 256,
+		.size_dist = SYNTH_PARETO,
+		.rect = 1,
+		.circle = 1,
+		.scale = 0.2,
+		.animated = 0.1,
+		.key_duration = 2,
+		.seed = 1,
+	};
+}
+
+bool synth_params_set(struct synth_params *p, const char *name, const char *value) {
+	if (strcmp(name, "objects") == 0)
+		p->nobjects = atoi(value);
+	else if (strcmp(name, "layers") == 0)
+		p->nlayers = atoi(value);
+	else if (strcmp(name, "min_size") == 0)
+		p->min_size = atoi(value);
+	else if (strcmp(name, "max_size") == 0)
+		p->max_size = atoi(value);
+	else if (strcmp(name, "size_dist") == 0)
+		p->size_dist = strcmp(value, "uniform") == 0 ? SYNTH_UNIFORM : SYNTH_PARETO;
+	else if (strcmp(name, "rect") == 0)
+		p->rect = atof(value);
+	else if (strcmp(name, "circle") == 0)
+		p->circle = atof(value);
+	else if (strcmp(name, "scale") == 0)
+		p->scale = atof(value);
+	else if (strcmp(name, "animated") == 0)
+		p->animated = atof(value);
+	else if (strcmp(name, "key_duration") == 0)
+		p->key_duration = atof(value);
+	else if (strcmp(name, "seed") == 0)
+		p->seed = strtoul(value, NULL, 0);
+	else
+		return false;
+	return true;
+}
+
+static void next_key(keyed *v, struct key_frame *k, bool finished, void *ud) {
+	struct anim *a = ud;
+	keyed_new_linear_key(v, rndf(&a->seed)*a->range, a->duration, next_key, a);
+}
+
+static var *position(struct interpolate_man *im, uint32_t *seed, double range,
+                     bool animated, const struct synth_params *p) {
+	double start = rndf(seed)*range;
+	if (!animated)
+		return vC(start);
+
+	auto v = new_keyed(im, start);
+	auto a = amalloc(struct anim, 1);
+	a->seed = rnd(seed) | 1;
+	a->range = range;
+	// Spread the durations out, so keyframes don't all end on one frame
+	a->duration = p->key_duration*(0.5+rndf(seed));
+	next_key((void *)v, NULL, false, a);
+	return v;
+}
+
+static int size(uint32_t *seed, const struct synth_params *p) {
+	double u = rndf(seed);
+	if (p->size_dist == SYNTH_UNIFORM)
+		return p->min_size+u*(p->max_size-p->min_size);
+	// Pareto with shape 1.5, cut off at max_size
+	double s = p->min_size/pow(1-u, 1/1.5);
+	return s > p->max_size ? p->max_size : s;
+}
+
+static void free_synth_image(void *fb) {
+	resample_forget(fb);
+	free_fb(fb);
+}
+
+// A translucent gradient with a checker pattern, premultiplied
+static struct fb *synth_image(void) {
+	auto fb = new_fb(SYNTH_IMAGE_SIZE, SYNTH_IMAGE_SIZE, ARGB8888);
+	if (!fb)
+		return NULL;
+	// The scale objects using it are made after, so they let go of
+	// their cached copies first
+	arena_defer_current(free_synth_image, fb);
+	for (int32_t i = 0; i < fb->height; i++) {
+		auto row = (uint32_t *)(fb->data+i*fb->pitch);
+		for (int32_t j = 0; j < fb->width; j++) {
+			uint32_t a = ((i/32+j/32)&1) ? 255 : 128;
+			uint32_t r = i*a/fb->height, g = j*a/fb->width, b = a/2;
+			row[j] = a<<24 | r<<16 | g<<8 | b;
+		}
+	}
+	return fb;
+}
+
+struct scene *build_synth_scene(struct interpolate_man *im, const struct synth_params *p,
+                                uint32_t w, uint32_t h) {
+	if (p->nlayers <= 0 || p->min_size <= 0 || p->max_size < p->min_size) {
+		fprintf(stderr, "Invalid synthetic scene parameters\n");
+		return NULL;
+	}
+	double total = p->rect+p->circle+p->scale;
+	if (total <= 0) {
+		fprintf(stderr, "Synthetic scene needs at least one object type\n");
+		return NULL;
+	}
+
+	uint32_t seed = p->seed ? p->seed : 1;
+	struct fb *image = NULL;
+	auto s = new_scene(p->nlayers);
+	for (int i = 0; i < p->nobjects; i++) {
+		int ow = size(&seed, p), oh = size(&seed, p);
+		bool animated = rndf(&seed) < p->animated;
+		auto x = position(im, &seed, (int)h > oh ? (int)h-oh : 0, animated, p);
+		auto y = position(im, &seed, (int)w > ow ? (int)w-ow : 0, animated, p);
+		var *r = vC(rnd(&seed)&255), *g = vC(rnd(&seed)&255),
+		    *b = vC(rnd(&seed)&255), *a = vC(64+rnd(&seed)%192);
+
+		struct object *o;
+		double type = rndf(&seed)*total;
+		if (type < p->rect)
+			o = new_rect(x, y, vC(ow), vC(oh), r, g, b, a);
+		else if (type < p->rect+p->circle)
+			o = new_ellipse(x, y, vC(ow), vC(oh), r, g, b, a, vC(0));
+		else {
+			if (!image && !(image = synth_image()))
+				return NULL;
+			o = new_scale(x, y, vC(ow), vC(oh), image);
+		}
+		list_add_tail(&o->siblings, &s->layer[i%p->nlayers]);
+	}
+	fprintf(stderr, "Synthetic scene: %d objects in %d layers\n", p->nobjects, p->nlayers);
+	return s;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Synthetic scenes, for seeing how coral scales with scene size. Objects
+// are spread over the layers round robin, with random position, size and
+// colour. Animated objects keep moving to random positions.
+
+enum synth_size_dist {
+	SYNTH_UNIFORM, // sizes evenly spread over [min_size, max_size]
+	SYNTH_PARETO,  // mostly small objects and a few big ones, like a UI
+};
+
+struct synth_params {
+	int nobjects, nlayers;
+	int min_size, max_size;
+	enum synth_size_dist size_dist;
+	// Relative weights of the object types
+	double rect, circle, scale;
+	// Fraction of objects that move
+	double animated;
+	// Seconds each keyframe of a moving object lasts
+	double key_duration;
+	uint32_t seed;
+};
+
+struct interpolate_man;
+struct scene;
+
+void synth_params_default(struct synth_params *);
+// Set the parameter called name from its string value, false if there is
+// no such parameter
+bool synth_params_set(struct synth_params *, const char *name, const char *value);
+struct scene *build_synth_scene(struct interpolate_man *, const struct synth_params *,
+                                uint32_t w, uint32_t h);
@@ -0,0 +1,330 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "common.h"
+#include "arena.h"
+#include "object.h"
+#include "interpolate.h"
+#include "tape.h"
+
+// Load an opaque var into the tape, the other instructions are enum op
+#define LOAD (NEG+1)
+// Slot numbers have to fit in an expression key
+#define MAX_SLOTS (1<<29)
+
+struct insn {
+	int op;
+	int32_t dst, a, b;
+	var *src; // LOAD only
+};
+
+struct tape_var {
+	var base;
+	struct tape *t;
+	int32_t slot;
+};
+
+struct tape {
+	double *val;
+	bool *chg;
+	int nslots, slot_cap;
+	struct insn *code;
+	int ncode, code_cap;
+	// Vars handed to objects, one per slot, made on demand
+	struct tape_var **vars;
+	struct tape_stats stats;
+};
+
+static double tape_var_current(var *v) {
+	struct tape_var *tv = (void *)v;
+	return tv->t->val[tv->slot];
+}
+
+static bool tape_var_changed(var *v) {
+	struct tape_var *tv = (void *)v;
+	return tv->t->chg[tv->slot];
+}
+
+static const struct var_ops tape_var_ops = {
+	.current = tape_var_current,
+	.changed = tape_var_changed,
+};
+
+// Open addressing hash map from 64-bit keys to slots
+struct hmap {
+	uint64_t *key;
+	int32_t *val;
+	bool *used;
+	size_t cap, n;
+};
+
+static uint64_t hash64(uint64_t x) {
+	x ^= x>>33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x>>33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x>>33;
+	return x;
+}
+
+static int32_t *hmap_find(struct hmap *m, uint64_t key) {
+	if (!m->cap)
+		return NULL;
+	for (size_t i = hash64(key)&(m->cap-1); m->used[i]; i = (i+1)&(m->cap-1))
+		if (m->key[i] == key)
+			return &m->val[i];
+	return NULL;
+}
+
+static void hmap_put(struct hmap *m, uint64_t key, int32_t val) {
+	if ((m->n+1)*2 > m->cap) {
+		struct hmap old = *m;
+		m->cap = m->cap ? m->cap*2 : 64;
+		m->key = malloc(sizeof(uint64_t)*m->cap);
+		m->val = malloc(sizeof(int32_t)*m->cap);
+		m->used = calloc(m->cap, sizeof(bool));
+		m->n = 0;
+		for (size_t i = 0; i < old.cap; i++)
+			if (old.used[i])
+				hmap_put(m, old.key[i], old.val[i]);
+		free(old.key);
+		free(old.val);
+		free(old.used);
+	}
+	size_t i = hash64(key)&(m->cap-1);
+	while (m->used[i])
+		i = (i+1)&(m->cap-1);
+	m->used[i] = true;
+	m->key[i] = key;
+	m->val[i] = val;
+	m->n++;
+}
+
+static void hmap_fini(struct hmap *m) {
+	free(m->key);
+	free(m->val);
+	free(m->used);
+}
+
+struct compiler {
+	struct tape *t;
+	bool *is_const; // per slot
+	struct hmap byvar, byconst, byexpr;
+};
+
+static int32_t new_slot(struct compiler *c) {
+	auto t = c->t;
+	assert(t->nslots < MAX_SLOTS);
+	if (t->nslots == t->slot_cap) {
+		t->slot_cap = t->slot_cap ? t->slot_cap*2 : 64;
+		t->val = realloc(t->val, sizeof(double)*t->slot_cap);
+		t->chg = realloc(t->chg, sizeof(bool)*t->slot_cap);
+		c->is_const = realloc(c->is_const, sizeof(bool)*t->slot_cap);
+	}
+	t->val[t->nslots] = 0;
+	t->chg[t->nslots] = false;
+	c->is_const[t->nslots] = false;
+	return t->nslots++;
+}
+
+static void emit(struct compiler *c, struct insn in) {
+	auto t = c->t;
+	if (t->ncode == t->code_cap) {
+		t->code_cap = t->code_cap ? t->code_cap*2 : 64;
+		t->code = realloc(t->code, sizeof(struct insn)*t->code_cap);
+	}
+	t->code[t->ncode++] = in;
+}
+
+static int32_t const_slot(struct compiler *c, double value) {
+	uint64_t key;
+	memcpy(&key, &value, sizeof(key));
+	auto found = hmap_find(&c->byconst, key);
+	if (found)
+		return *found;
+
+	int32_t slot = new_slot(c);
+	c->t->val[slot] = value;
+	c->is_const[slot] = true;
+	c->t->stats.consts++;
+	hmap_put(&c->byconst, key, slot);
+	return slot;
+}
+
+static double apply(int op, double a, double b) {
+	switch (op) {
+	case ADD: return a+b;
+	case SUB: return a-b;
+	case MUL: return a*b;
+	case DIV: return a/b;
+	case NEG: return -a;
+	default: assert(false); __builtin_unreachable();
+	}
+}
+
+static bool is_const_value(struct compiler *c, int32_t slot, double value) {
+	return slot >= 0 && c->is_const[slot] && c->t->val[slot] == value;
+}
+
+static int32_t op_slot(struct compiler *c, int op, int32_t a, int32_t b) {
+	auto t = c->t;
+	if (c->is_const[a] && (b < 0 || c->is_const[b]))
+		return const_slot(c, apply(op, t->val[a], b < 0 ? 0 : t->val[b]));
+
+	// Identities that hold for every double. x+0 isn't one of them,
+	// -0.0+0 is +0.0, but x-(+0.0) is.
+	if (op == SUB && is_const_value(c, b, 0) && !signbit(t->val[b]))
+		return a;
+	if ((op == MUL || op == DIV) && is_const_value(c, b, 1))
+		return a;
+	if (op == MUL && is_const_value(c, a, 1))
+		return b;
+
+	if ((op == ADD || op == MUL) && a > b) {
+		int32_t tmp = a;
+		a = b;
+		b = tmp;
+	}
+	uint64_t key = (uint64_t)op<<60 | (uint64_t)a<<30 | (uint64_t)(b+1);
+	auto found = hmap_find(&c->byexpr, key);
+	if (found)
+		return *found;
+
+	int32_t slot = new_slot(c);
+	emit(c, (struct insn){ op, slot, a, b, NULL });
+	t->stats.ops++;
+	hmap_put(&c->byexpr, key, slot);
+	return slot;
+}
+
+static int32_t compile(struct compiler *c, var *v) {
+	auto found = hmap_find(&c->byvar, (uintptr_t)v);
+	if (found)
+		return *found;
+
+	c->t->stats.nodes++;
+	struct var_info info;
+	var_inspect(v, &info);
+	int32_t slot;
+	switch (info.kind) {
+	case VAR_CONST:
+		slot = const_slot(c, info.value);
+		break;
+	case VAR_ARITH: {
+		int32_t a = compile(c, info.a);
+		int32_t b = info.b ? compile(c, info.b) : -1;
+		slot = op_slot(c, info.op, a, b);
+		break;
+	}
+	default:
+		slot = new_slot(c);
+		emit(c, (struct insn){ LOAD, slot, -1, -1, v });
+		c->t->stats.inputs++;
+		break;
+	}
+	hmap_put(&c->byvar, (uintptr_t)v, slot);
+	return slot;
+}
+
+static var *slot_var(struct tape *t, int32_t slot) {
+	if (!t->vars[slot]) {
+		auto tv = amalloc(struct tape_var, 1);
+		tv->base.ops = &tape_var_ops;
+		tv->t = t;
+		tv->slot = slot;
+		t->vars[slot] = tv;
+	}
+	return &t->vars[slot]->base;
+}
+
+static void tape_free(void *_t) {
+	struct tape *t = _t;
+	free(t->val);
+	free(t->chg);
+	free(t->code);
+	free(t->vars);
+	free(t);
+}
+
+struct tape *tape_compile(struct scene *s) {
+	struct compiler c = {
+		.t = tmalloc(struct tape, 1),
+	};
+	auto t = c.t;
+	// The tape and its vars go with the scene
+	auto prev = arena_set_current(s->arena);
+	arena_defer_current(tape_free, t);
+
+	// Compile everything first, slots aren't final until then
+	struct object *o;
+	for (int i = 0; i < s->nlayers; i++) {
+		list_for_each_entry(o, &s->layer[i], siblings) {
+			compile(&c, o->x);
+			compile(&c, o->y);
+			compile(&c, o->w);
+			compile(&c, o->h);
+			for (int j = 0; j < o->nparams; j++)
+				compile(&c, o->param[j]);
+		}
+	}
+
+	t->vars = calloc(t->nslots, sizeof(struct tape_var *));
+#define REPLACE(v) (v) = slot_var(t, *hmap_find(&c.byvar, (uintptr_t)(v)))
+	for (int i = 0; i < s->nlayers; i++) {
+		list_for_each_entry(o, &s->layer[i], siblings) {
+			REPLACE(o->x);
+			REPLACE(o->y);
+			REPLACE(o->w);
+			REPLACE(o->h);
+			for (int j = 0; j < o->nparams; j++)
+				REPLACE(o->param[j]);
+		}
+	}
+#undef REPLACE
+	t->stats.slots = t->nslots;
+
+	hmap_fini(&c.byvar);
+	hmap_fini(&c.byconst);
+	hmap_fini(&c.byexpr);
+	free(c.is_const);
+
+	arena_set_current(prev);
+
+	s->tape = t;
+	tape_eval(t);
+	return t;
+}
+
+void tape_eval(struct tape *t) {
+	double *val = t->val;
+	bool *chg = t->chg;
+	for (int i = 0; i < t->ncode; i++) {
+		auto in = &t->code[i];
+		switch (in->op) {
+		case LOAD:
+			val[in->dst] = V(in->src);
+			chg[in->dst] = C(in->src);
+			continue;
+		case ADD: val[in->dst] = val[in->a]+val[in->b]; break;
+		case SUB: val[in->dst] = val[in->a]-val[in->b]; break;
+		case MUL: val[in->dst] = val[in->a]*val[in->b]; break;
+		case DIV: val[in->dst] = val[in->a]/val[in->b]; break;
+		case NEG:
+			val[in->dst] = -val[in->a];
+			chg[in->dst] = chg[in->a];
+			continue;
+		}
+		chg[in->dst] = chg[in->a] || chg[in->b];
+	}
+	// The tape vars have new values
+	var_new_epoch();
+}
+
+void tape_get_stats(const struct tape *t, struct tape_stats *s) {
+	*s = t->stats;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+
+// A scene's var graph, compiled into a flat list of instructions that is
+// run once per frame.
+//
+// Constants are folded and interned, common subexpressions share one
+// slot, and what's left is put in topological order. Vars that can't be
+// looked into (keyed vars, mostly) are loaded into the tape as inputs.
+// The objects' vars are then replaced with vars that read their slot of
+// the tape, so V() and C() on them are just loads.
+
+struct scene;
+struct tape;
+
+struct tape_stats {
+	int nodes;   // var nodes reachable from the objects
+	int slots;   // after folding, interning and CSE
+	int consts, inputs, ops;
+};
+
+// Compile all vars used by the objects in s, and attach the tape to s.
+// Objects added to s later keep their vars as they are. The tape is
+// freed with the scene's arena.
+struct tape *tape_compile(struct scene *s);
+// Compute every slot, render_scene() does this at the start of a frame
+void tape_eval(struct tape *);
+void tape_get_stats(const struct tape *, struct tape_stats *);
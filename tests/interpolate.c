@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <math.h>
+#include <assert.h>
+
+#include "common.h"
+#include "arena.h"
+#include "interpolate.h"
+
+// Key frame callbacks are free to truncate their var and give it new key
+// frames, the way the scene's mouse handlers do.
+
+static bool near(double a, double b) {
+	return fabs(a-b) < 1e-9;
+}
+
+static int ncalls;
+
+static void rekey(keyed *v, struct key_frame *k, bool finished, void *ud) {
+	ncalls++;
+	assert(finished);
+	keyed_truncate(v);
+	keyed_new_linear_key(v, 20, 1, NULL, NULL);
+}
+
+static void chain(keyed *v, struct key_frame *k, bool finished, void *ud) {
+	ncalls++;
+	keyed_new_linear_key(v, 10*(ncalls+1), 1, ncalls < 3 ? chain : NULL, NULL);
+}
+
+// A finishing key frame truncates its var, dropping the key frame queued
+// after it, and adds a new one
+static void test_truncate_in_callback(void) {
+	auto a = arena_new();
+	arena_set_current(a);
+	auto im = interpolate_man_new();
+	auto v = new_keyed(im, 0);
+	ncalls = 0;
+	keyed_new_linear_key((void *)v, 10, 1, rekey, NULL);
+	keyed_new_linear_key((void *)v, -100, 1, NULL, NULL);
+
+	interpolate_man_advance_to(im, 0.5);
+	assert(near(V(v), 5));
+	// The new key frame starts when the old one ended, not at 1.5
+	interpolate_man_advance_to(im, 1.5);
+	assert(ncalls == 1);
+	assert(near(V(v), 15));
+	interpolate_man_advance_to(im, 3);
+	assert(near(V(v), 20));
+	assert(!interpolate_man_active(im));
+
+	struct interpolate_stats s;
+	interpolate_man_get_stats(im, &s);
+	assert(s.keys_live == 0);
+	arena_set_current(NULL);
+	arena_free(a);
+}
+
+// Callbacks that add the next key frame when theirs finishes, several of
+// them passing in one advance
+static void test_chain_in_callback(void) {
+	auto a = arena_new();
+	arena_set_current(a);
+	auto im = interpolate_man_new();
+	auto v = new_keyed(im, 0);
+	ncalls = 0;
+	keyed_new_linear_key((void *)v, 10, 1, chain, NULL);
+
+	interpolate_man_advance_to(im, 2.5);
+	assert(ncalls == 2);
+	assert(near(V(v), 25));
+	interpolate_man_advance_to(im, 10);
+	assert(ncalls == 3);
+	assert(near(V(v), 40));
+
+	struct interpolate_stats s;
+	interpolate_man_get_stats(im, &s);
+	assert(s.keys_live == 0);
+	arena_set_current(NULL);
+	arena_free(a);
+}
+
+int main() {
+	test_truncate_in_callback();
+	test_chain_in_callback();
+	printf("ok\n");
+	return 0;
+}
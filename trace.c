@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "trace.h"
+
+// Must be a power of two
+#define RING_SIZE (1u<<16)
+// How often the writer thread drains the ring
+#define FLUSH_INTERVAL_MS 50
+
+struct event {
+	// Bounded MPMC queue sequence: == slot index when free for the
+	// producer of that index, == index+1 once the event is written
+	_Atomic uint64_t seq;
+	const char *name, *arg_name;
+	uint64_t start, end; // end == 0 for instant events
+	int64_t arg;
+	int32_t tid;
+};
+
+static struct {
+	struct event *ring;
+	_Atomic uint64_t head; // next slot to write
+	uint64_t tail;         // next slot to read, writer thread only
+	_Atomic uint64_t dropped;
+
+	FILE *out;
+	bool first;
+	pthread_t thread;
+	_Atomic bool stop;
+} trace;
+
+bool trace_on;
+
+static _Thread_local int32_t tid;
+
+uint64_t trace_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ull+ts.tv_nsec;
+}
+
+static void push(const char *name, uint64_t start, uint64_t end,
+                 const char *arg_name, int64_t arg) {
+	if (!tid)
+		tid = syscall(SYS_gettid);
+
+	struct event *e;
+	uint64_t pos = atomic_load_explicit(&trace.head, memory_order_relaxed);
+	while (true) {
+		e = &trace.ring[pos&(RING_SIZE-1)];
+		uint64_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+		int64_t diff = (int64_t)(seq-pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&trace.head, &pos, pos+1,
+			    memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			// Full, the writer thread is behind
+			atomic_fetch_add_explicit(&trace.dropped, 1, memory_order_relaxed);
+			return;
+		} else
+			pos = atomic_load_explicit(&trace.head, memory_order_relaxed);
+	}
+
+	e->name = name;
+	e->arg_name = arg_name;
+	e->start = start;
+	e->end = end;
+	e->arg = arg;
+	e->tid = tid;
+	atomic_store_explicit(&e->seq, pos+1, memory_order_release);
+}
+
+void trace_complete(const char *name, uint64_t start, uint64_t end,
+                    const char *arg_name, int64_t arg) {
+	push(name, start, end, arg_name, arg);
+}
+
+void trace_instant(const char *name, const char *arg_name, int64_t arg) {
+	if (trace_on)
+		push(name, trace_clock(), 0, arg_name, arg);
+}
+
+static void write_event(const struct event *e) {
+	fprintf(trace.out, "%s\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+	        trace.first ? "" : ",", e->name, getpid(), e->tid, e->start/1e3);
+	if (e->end)
+		fprintf(trace.out, ",\"ph\":\"X\",\"dur\":%.3f", (e->end-e->start)/1e3);
+	else
+		fprintf(trace.out, ",\"ph\":\"i\",\"s\":\"g\"");
+	if (e->arg_name)
+		fprintf(trace.out, ",\"args\":{\"%s\":%ld}", e->arg_name, e->arg);
+	fprintf(trace.out, "}");
+	trace.first = false;
+}
+
+static void drain(void) {
+	while (true) {
+		auto e = &trace.ring[trace.tail&(RING_SIZE-1)];
+		uint64_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+		if (seq != trace.tail+1)
+			break;
+		write_event(e);
+		atomic_store_explicit(&e->seq, trace.tail+RING_SIZE, memory_order_release);
+		trace.tail++;
+	}
+}
+
+static void *writer(void *ud) {
+	const struct timespec interval = { 0, FLUSH_INTERVAL_MS*1000000l };
+	while (!atomic_load(&trace.stop)) {
+		nanosleep(&interval, NULL);
+		drain();
+	}
+	return NULL;
+}
+
+bool trace_start(const char *path) {
+	if (trace_on)
+		return true;
+	trace.out = fopen(path, "w");
+	if (!trace.out) {
+		fprintf(stderr, "Could not open trace file %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	trace.ring = tmalloc(struct event, RING_SIZE);
+	for (uint64_t i = 0; i < RING_SIZE; i++)
+		atomic_init(&trace.ring[i].seq, i);
+	atomic_init(&trace.head, 0);
+	atomic_init(&trace.stop, false);
+	trace.tail = 0;
+	trace.first = true;
+	fprintf(trace.out, "[");
+	if (pthread_create(&trace.thread, NULL, writer, NULL) != 0) {
+		fprintf(stderr, "Could not start the trace writer\n");
+		fclose(trace.out);
+		free(trace.ring);
+		return false;
+	}
+	trace_on = true;
+	return true;
+}
+
+void trace_stop(void) {
+	if (!trace_on)
+		return;
+	trace_on = false;
+	atomic_store(&trace.stop, true);
+	pthread_join(trace.thread, NULL);
+	drain();
+	fprintf(trace.out, "\n]\n");
+	fclose(trace.out);
+	free(trace.ring);
+	uint64_t dropped = atomic_load(&trace.dropped);
+	if (dropped)
+		fprintf(stderr, "trace: %lu events dropped\n", dropped);
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Optional tracing of the render loop, written out in Chrome's trace event
+// format (load it in chrome://tracing or ui.perfetto.dev).
+//
+// Events go into a fixed size lock-free ring, any thread can record. A
+// background thread drains the ring into the file, so recording is only
+// a few atomic ops. If the ring is full, events are dropped and counted.
+//
+// Names must be string literals, only the pointer is recorded.
+
+extern bool trace_on;
+
+// Start writing to path, false if it can't be opened
+bool trace_start(const char *path);
+// Flush everything and close the file
+void trace_stop(void);
+
+uint64_t trace_clock(void);
+void trace_complete(const char *name, uint64_t start, uint64_t end,
+                    const char *arg_name, int64_t arg);
+void trace_instant(const char *name, const char *arg_name, int64_t arg);
+
+// Spans are recorded when they end:
+//
+//	uint64_t t = trace_begin();
+//	...
+//	trace_end("name", t);
+static inline uint64_t trace_begin(void) {
+	return trace_on ? trace_clock() : 0;
+}
+
+static inline void trace_end(const char *name, uint64_t start) {
+	if (trace_on && start)
+		trace_complete(name, start, trace_clock(), NULL, 0);
+}
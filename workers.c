@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "workers.h"
+
+struct workers {
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	pthread_t *threads;
+	int nthreads;
+
+	// Current batch, protected by lock, except next which is grabbed
+	// with atomics
+	unsigned long generation;
+	void (*fn)(int, void *);
+	void *ud;
+	int njobs;
+	atomic_int next;
+	int running;
+	bool quit;
+};
+
+static void run_jobs(struct workers *w) {
+	int job;
+	while ((job = atomic_fetch_add(&w->next, 1)) < w->njobs)
+		w->fn(job, w->ud);
+}
+
+static void *worker_main(void *arg) {
+	struct workers *w = arg;
+	unsigned long seen = 0;
+	pthread_mutex_lock(&w->lock);
+	while (true) {
+		while (!w->quit && w->generation == seen)
+			pthread_cond_wait(&w->start, &w->lock);
+		if (w->quit)
+			break;
+		seen = w->generation;
+		pthread_mutex_unlock(&w->lock);
+
+		run_jobs(w);
+
+		pthread_mutex_lock(&w->lock);
+		if (--w->running == 0)
+			pthread_cond_signal(&w->done);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+struct workers *workers_new(int nthreads) {
+	if (nthreads < 1)
+		nthreads = 1;
+	auto w = tmalloc(struct workers, 1);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->start, NULL);
+	pthread_cond_init(&w->done, NULL);
+	w->threads = tmalloc(pthread_t, nthreads-1);
+	w->nthreads = 1;
+	for (int i = 0; i < nthreads-1; i++) {
+		if (pthread_create(&w->threads[i], NULL, worker_main, w) != 0)
+			break;
+		w->nthreads++;
+	}
+	return w;
+}
+
+void workers_free(struct workers *w) {
+	if (!w)
+		return;
+	pthread_mutex_lock(&w->lock);
+	w->quit = true;
+	pthread_cond_broadcast(&w->start);
+	pthread_mutex_unlock(&w->lock);
+	for (int i = 0; i < w->nthreads-1; i++)
+		pthread_join(w->threads[i], NULL);
+	pthread_cond_destroy(&w->start);
+	pthread_cond_destroy(&w->done);
+	pthread_mutex_destroy(&w->lock);
+	free(w->threads);
+	free(w);
+}
+
+int workers_nthreads(const struct workers *w) {
+	return w ? w->nthreads : 1;
+}
+
+void workers_run(struct workers *w, int njobs, void (*fn)(int, void *), void *ud) {
+	if (!w || w->nthreads == 1 || njobs <= 1) {
+		for (int i = 0; i < njobs; i++)
+			fn(i, ud);
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	w->fn = fn;
+	w->ud = ud;
+	w->njobs = njobs;
+	atomic_store(&w->next, 0);
+	w->running = w->nthreads-1;
+	w->generation++;
+	pthread_cond_broadcast(&w->start);
+	pthread_mutex_unlock(&w->lock);
+
+	run_jobs(w);
+
+	pthread_mutex_lock(&w->lock);
+	while (w->running)
+		pthread_cond_wait(&w->done, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+// A fixed pool of threads that run batches of independent jobs.
+struct workers;
+
+// nthreads counts the calling thread, which takes part in every batch.
+// So nthreads == 1 creates no threads at all.
+struct workers *workers_new(int nthreads);
+void workers_free(struct workers *);
+int workers_nthreads(const struct workers *);
+
+// Call fn(job, ud) for job in [0, njobs), spread across the pool, and
+// wait for all of them to finish. w can be NULL, then everything runs on
+// the calling thread.
+void workers_run(struct workers *w, int njobs, void (*fn)(int job, void *ud), void *ud);